@@ -3,27 +3,95 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 //== == == == == == == == == == == == == == == == == == == == == == == == ==
 
 /*** defines ***/
 #define TTE_VERSION "0.0.1"
 #define TTE_TAB_STOP 4
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define WRITEBUF_INIT {NULL, 0}
+#define WRITEBUF_INIT {NULL, 0, 0}
 #define TTE_QUIT_TIMES 3
 #define TTE_SIDE_PANEL_WIDTH 5
 #define TTE_MAX_FILENAME_DISPLAYED 20
+#define PERF_BUCKETS 256
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_MAX_CLASS_SIZE (ARENA_BLOCK_SIZE / 4)
+#define ARENA_CLASSES 31  // 8, 12, 16, 24, ... up to ARENA_MAX_CLASS_SIZE
+#define TTE_READ_CHUNK (1 << 20)
+#define TTE_FILTER_CHUNK (1 << 16)
+#define TTE_FILTER_REDRAW_MS 100
+#define TTE_PARALLEL_MIN (1 << 16)
+#define TTE_MAX_WORKERS 16
+#define TTE_CACHE_MAGIC "TTEIDX01"
+#define TTE_CACHE_MIN_BYTES (1 << 20)  // smaller files are not worth caching
+#define TTE_CACHE_SAMPLE (1 << 16)
+#define TTE_LOAD_SLICE 16384  // rows read at a time by a lazy open
+#define TTE_COLD_BLOCK (1 << 16)  // text of the rows frozen into one block
+#define TTE_COLD_CACHE 16         // decompressed blocks kept around
+#define TTE_COLD_SLACK 4096       // warm rows gained before freezing again
+#define TTE_OFFSET_BLOCK 128      // rows per block of the byte offset index
+#define LOG_SLOTS 512
+#define LOG_SLOT_SIZE 120
+#define LOG_FLUSH_INTERVAL_MS 50
+
+// log levels, anything above TTE_LOG_LEVEL is compiled out
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#ifndef TTE_LOG_LEVEL
+#define TTE_LOG_LEVEL LOG_INFO
+#endif
+
+#define logError(...) logWrite(LOG_ERROR, __VA_ARGS__)
+#if TTE_LOG_LEVEL >= LOG_WARN
+#define logWarn(...) logWrite(LOG_WARN, __VA_ARGS__)
+#else
+#define logWarn(...) ((void)0)
+#endif
+#if TTE_LOG_LEVEL >= LOG_INFO
+#define logInfo(...) logWrite(LOG_INFO, __VA_ARGS__)
+#else
+#define logInfo(...) ((void)0)
+#endif
+#if TTE_LOG_LEVEL >= LOG_DEBUG
+#define logDebug(...) logWrite(LOG_DEBUG, __VA_ARGS__)
+#else
+#define logDebug(...) ((void)0)
+#endif
+// timing hooks around the hot paths, a single branch when profiling is off
+#define PERF_START(var) long long var = PS.enabled ? monotonicNs() : 0
+#define PERF_END(stage, var)                                               \
+    do {                                                                   \
+        if (PS.enabled)                                                    \
+            perfRecord(&PS.hist[stage], (monotonicNs() - (var)) / 1000);   \
+    } while (0)
 //== == == == == == == == == == == == == == == == == == == == == == == ==
 
 /*** data ***/
@@ -53,10 +121,141 @@ enum graphicPara {
 typedef struct erow {
     int size;
     int rsize;
-    char *chars;
+    int cap;             // bytes reserved for chars, or where a frozen row's
+                         // chars start in the text of its cold block
+    int rcap;            // bytes reserved for render
+    unsigned int epoch;  // render is only valid while this matches the buffer
+    bool ascii;          // chars are pure ASCII, so a byte is one column
+    bool tabs;           // chars contain tabs, so render differs from chars
+    uint64_t hash;       // rowHash of chars
+    char *chars;         // NULL while the row is frozen
     char *render;
+    struct coldBlock *cold;  // block holding the chars of a frozen row
 } erow;
 
+// Chunk of memory rows are carved out of. Allocations bigger than a quarter
+// of a block get a block of their own.
+struct arenaBlock {
+    struct arenaBlock *next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+// Slab allocator owning the text of one buffer, so closing the buffer frees
+// all of its rows at once instead of row by row. Fresh allocations are carved
+// exactly from the current block, so rows loaded together sit next to each
+// other. Released chunks go on a free list per size class (sizes grow by 1.5x)
+// and are handed out again to allocations of at most that class size.
+struct rowArena {
+    struct arenaBlock *blocks;  // block being carved first
+    char *free_list[ARENA_CLASSES];
+    size_t reserved;            // bytes obtained from malloc
+    size_t live;                // bytes handed out and not released
+    size_t free_bytes;          // bytes waiting on the free lists
+};
+
+// Compressed text of a run of rows frozen together. Decompressed, it holds
+// the chars of each row followed by a '\0'.
+struct coldBlock {
+    struct coldBlock *prev;      // blocks of the same buffer
+    struct coldBlock *next;
+    struct coldBlock *lru_prev;  // cached blocks, most recently used first
+    struct coldBlock *lru_next;
+    char *text;                  // decompressed text while cached, else NULL
+    int text_len;
+    int refs;                    // frozen rows pointing into the block
+    int len;                     // compressed bytes in data
+    char data[];
+};
+
+// decompressed cold blocks of every buffer
+struct coldCache {
+    struct coldBlock *head;
+    struct coldBlock *tail;
+    int len;
+    size_t bytes;
+};
+
+// identity and version of a file as seen by stat
+struct fileStamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+};
+
+// hash and position of every line of a file
+struct lineIndex {
+    uint64_t *hash;     // rowHash of each line
+    long long *offset;  // where each line starts, then the file size
+    int lines;
+    int cap;
+};
+
+// header of a line cache file, followed by lines + 1 offsets and lines
+// hashes of a struct lineIndex
+struct lineCacheHeader {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t sample;    // hash of the start and the end of the file
+    int64_t lines;
+    int64_t max_cols;
+    uint64_t checksum;  // of the offsets and hashes
+};
+
+// Hashes of the lines of a file, computed by a worker thread so a reload
+// can tell which rows changed without the editor reading the whole file.
+struct reloadJob {
+    pthread_t thread;
+    bool done;  // set by the worker once the fields below are filled in
+    bool failed;
+    int fd;
+    struct fileStamp stamp;  // the file as it was hashed
+    struct lineIndex index;
+};
+
+// Fenwick tree of row byte lengths, see byte offsets
+struct byteIndex {
+    long long *rows;       // rows in each block
+    long long *bytes;      // bytes in each block
+    long long *row_tree;   // Fenwick trees over rows and bytes, 1-based
+    long long *byte_tree;
+    int blocks;
+    int cap;               // blocks allocated
+    int n;                 // rows covered
+    bool valid;            // no rows were reordered since built
+};
+
+// The last multi-cursor edit or line command, kept as one step to undo
+// until the buffer is changed in any other way; see undo
+struct undoRecord {
+    int kind;      // enum undoKind
+    int first;     // row the edit starts at
+    int count;     // rows it left from first on, or added at the end
+    erow *rows;    // rows it took out of the buffer, owned by the record
+    int *at;       // row each of rows or each saved text came from
+    int *end;      // where the saved text of each row ends
+    int len;       // entries in rows or end, and in at
+    int cap;
+    char *text;    // text of the rows a multi-cursor edit changed
+    int text_len;
+    int text_cap;
+    int cx;        // cursor before the edit
+    int cy;
+};
+
+// position of an additional cursor, in chars like cx/cy
+struct cursorPos {
+    int cy;
+    int cx;
+};
+
 struct editorConfig {
     int cx;             // Cursor Position X in the buffer (chars)
     int cy;             // Cursor Position Y in the buffer (chars)
@@ -76,26 +275,302 @@ struct editorConfig {
     char status_msg[80];
     time_t status_msg_time;
     bool dirty;
+    struct rowArena text;        // row chars of this buffer
+    struct rowArena render;      // row render caches of this buffer
+    unsigned int render_epoch;   // bumped to invalidate every render cache
+    struct cursorPos *cursors;   // extra cursors, sorted by row then column
+    int num_cursors;
+    int cursors_cap;
+    struct fileStamp disk;       // the file as last read or written
+    int watch;                   // inotify watch on the directory of the file
+    bool disk_check;             // an event may mean the file has changed
+    bool disk_changed;           // file changed under unsaved changes
+    struct reloadJob *reload;    // rehash of the file in progress
+    struct lineIndex saved;      // the lines as last read or written
+    int rows_differ;             // rows unlike the saved line at their index
+    bool rows_moved;             // rows_differ is stale, rows were moved
+    bool crlf;                   // the file's lines end in "\r\n"
+    int load_fd;                 // file rows are still read from, or -1
+    int load_next;               // saved line to read next
+    struct coldBlock *cold;      // blocks of the frozen rows
+    size_t cold_bytes;           // memory held by those blocks
+    int warm_rows;               // rows that are not frozen
+    int warm_mark;               // warm_rows that starts the next freeze
+    int freeze_next;             // row an interrupted freeze resumes at
+    struct byteIndex offsets;    // byte offset of every row
+    struct undoRecord undo;      // the last edit that can be undone
     struct termios org_termios;
 };
 
 struct editorConfig EC;
 
+// Open buffers. EC holds the state of the current buffer while it is active;
+// slot[current] is only brought up to date when switching away from it.
+struct bufferList {
+    struct editorConfig *slot;
+    int len;
+    int cap;
+    int current;
+};
+
+struct bufferList EB;
+
+enum perfStage {
+    PERF_KEY,     // editorProcessKeyPress
+    PERF_SCROLL,  // editorScroll
+    PERF_DRAW,    // editorDrawRows
+    PERF_WRITE,   // write of the frame to the terminal
+    PERF_FRAME,   // whole editorRefreshScreen
+    PERF_BYTES,   // bytes written per frame
+    PERF_STAGES
+};
+
+// log-linear histogram: values below 16 get their own bucket, above that each
+// power of two is split into 8 buckets, so percentiles are within ~12%.
+struct perfHist {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned int bucket[PERF_BUCKETS];
+};
+
+struct perfStats {
+    bool enabled;  // record timings, set by TTE_PERF or the overlay toggle
+    bool overlay;  // show p50/p99 in the status bar
+    struct perfHist hist[PERF_STAGES];
+};
+
+struct perfStats PS;
+
 struct writeBuf {
     char *pointer;
     int len;
+    int cap;
+};
+
+// graphic rendition of the terminal, colors are 0xRRGGBB or -1 for default
+struct sgrState {
+    int fg;
+    int bg;
+    bool invert;
+};
+
+// What the terminal shows, so that a frame only sends the screen lines that
+// changed since the previous one, and only the SGR attributes that change.
+// Every screen line is drawn starting and ending in the default rendition.
+struct screenCache {
+    uint64_t *line;        // key of what each screen line shows, 0 unknown
+    bool *drawn;           // line was sent in the frame being drawn
+    int lines;
+    int cursor_line;       // line the cursor is at the start of, or -1
+    struct sgrState attr;  // rendition the output so far leaves behind
+    bool attr_known;
+    char *gutter;          // TTE_SIDE_PANEL_WIDTH bytes per line in view
+    int gutter_first;      // line number of the first gutter
+    int gutter_count;
+};
+
+struct screenCache SC;
+
+// One log message. seq is the message number + 1 once the message is
+// complete and 0 while a writer is filling the slot.
+struct logSlot {
+    unsigned long long seq;
+    int level;
+    char msg[LOG_SLOT_SIZE];
+};
+
+// Fixed-size ring of log messages. Writers claim a slot with an atomic
+// increment of head and never block; when the ring is full the oldest
+// messages are overwritten and counted as dropped by the flusher. The ring
+// only goes to disk once it is worth keeping, so a session that went fine
+// leaves no Log.txt behind.
+struct logRing {
+    struct logSlot slot[LOG_SLOTS];
+    unsigned long long head;     // next message number to hand out
+    unsigned long long flushed;  // next message number to write to disk
+    unsigned long long dropped;
+    int fd;  // Log.txt, opened on the first flush that has messages
+    bool keep;  // a warning or error was logged, or the log was asked for
+    bool flusher_running;
+    bool flusher_stop;
+    pthread_t flusher;
+};
+
+struct logRing LR = {.fd = -1};
+
+// file descriptor that raw keystrokes are copied to when TTE_RECORD is set, so
+// a session can be replayed later by the headless benchmark.
+int ttyRecordFd = -1;
+
+// inotify instance watching the directories of open files, -1 until needed
+int inotifyFd = -1;
+
+// keep line indexes of large files in the cache directory, see line cache
+bool lineCacheEnabled = true;
+
+// freeze rows away from the view, set by TTE_COMPRESS, see cold rows
+bool coldRowsEnabled = false;
+
+// running a script with tte -b, there is no terminal to draw on; see batch
+bool batchMode = false;
+
+struct coldCache CC;
+
+// number of editorPrompt calls in progress; files are not reloaded under them
+int promptDepth = 0;
+
+#ifdef TTE_BENCH
+// Virtual terminal used by the headless benchmark build. Input comes from a
+// keystroke script and output is counted instead of being written to a tty.
+struct benchTerm {
+    int rows;
+    int cols;
+    const char *keys;     // keystroke script being replayed
+    int keys_len;
+    int keys_pos;
+    long long *lat;       // per key latency samples in nanoseconds
+    int lat_len;
+    int lat_cap;
+    long long last_key;   // timestamp of the previous key request
+    long long frames;     // number of writes to the terminal
+    long long out_bytes;  // total bytes written to the terminal
+    int max_frame_bytes;
 };
-struct writeBuf dLog = WRITEBUF_INIT;
+
+struct benchTerm BT;
+#endif
 
 //== == == == == == == == == == == == == == == == == == == == == == == == ==
 
 /*** function declaration ***/
 
 void editorClearScreen();
-void debugFileLog();
+void logClose();
+void lineCacheJoinWriters();
 void editorSetStatusMsg(char *fmt, ...);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void editorAppendClrToBuf(struct writeBuf *wBuf, int code, int r, int g, int b);
+void logWrite(int level, const char *fmt, ...);
+void perfDump();
+void editorInitBuffer();
+void editorRefreshScreen();
+void editorDropRenderCaches();
+void editorFreeRow(erow *row);
+bool editorCheckDisk();
+bool editorIdle();
+void editorLoadAll();
+void editorLoadRows(int rows);
+int editorWorkerCount(int items);
+void runParallel(void *(*fn)(void *), void *jobs, size_t size, int count);
+void editorStampFile(int fd);
+void editorUnwatchFile();
+void undoFree(struct undoRecord *undo);
+void editorClearCursors();
+void editorClampCursor();
+int editorLineEndLength();
+struct fileStamp fileStampOf(const struct stat *st);
+const char *fileBaseName(const char *path);
+bool fileStampEqual(struct fileStamp a, struct fileStamp b);
+struct reloadJob *editorTakeReload();
+void editorFreeReload(struct reloadJob *job);
+//== == == == == == == == == == == == == == == == == == == == == == == == ==
+
+/*** logging ***/
+
+// format a message into the next ring slot. Never allocates or blocks, so it
+// is safe on hot paths and from background threads.
+void logWrite(int level, const char *fmt, ...) {
+    unsigned long long n = __atomic_fetch_add(&LR.head, 1, __ATOMIC_RELAXED);
+    struct logSlot *slot = &LR.slot[n % LOG_SLOTS];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    va_end(ap);
+    slot->level = level;
+    __atomic_store_n(&slot->seq, n + 1, __ATOMIC_RELEASE);
+    if (level <= LOG_WARN) __atomic_store_n(&LR.keep, true, __ATOMIC_RELAXED);
+}
+
+// write every completed message that has not been flushed yet to Log.txt.
+// Only one thread flushes at a time: the flusher thread while it runs,
+// otherwise the UI thread at exit.
+void logFlush() {
+    static const char *names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+    if (!__atomic_load_n(&LR.keep, __ATOMIC_RELAXED)) return;
+    unsigned long long head = __atomic_load_n(&LR.head, __ATOMIC_ACQUIRE);
+    if (head - LR.flushed > LOG_SLOTS) {
+        LR.dropped += head - LR.flushed - LOG_SLOTS;
+        LR.flushed = head - LOG_SLOTS;
+    }
+
+    char out[LOG_SLOT_SIZE + 16];
+    while (LR.flushed < head) {
+        struct logSlot *slot = &LR.slot[LR.flushed % LOG_SLOTS];
+        unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != LR.flushed + 1) {
+            if (seq > LR.flushed + 1) {
+                LR.dropped++;  // overwritten while we were behind
+                LR.flushed++;
+                continue;
+            }
+            break;  // still being written, pick it up next time
+        }
+        int level = slot->level;
+        int len = snprintf(out, sizeof(out), "[%s] %s\n",
+                           names[level & 3], slot->msg);
+        if (len >= (int)sizeof(out)) len = sizeof(out) - 1;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) continue;
+
+        if (LR.fd == -1) {
+            LR.fd = open("Log.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (LR.fd == -1) return;
+        }
+        write(LR.fd, out, len);
+        LR.flushed++;
+    }
+}
+
+void *logFlusherMain(void *arg) {
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+    while (!__atomic_load_n(&LR.flusher_stop, __ATOMIC_ACQUIRE)) {
+        logFlush();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// start a background thread that drains the ring to disk periodically, so
+// long sessions keep their log without the UI thread ever touching the file.
+void logStartFlusher() {
+    LR.keep = true;
+    if (pthread_create(&LR.flusher, NULL, logFlusherMain, NULL) == 0) {
+        LR.flusher_running = true;
+    }
+}
+
+// stop the flusher and write out whatever is left
+void logClose() {
+    if (LR.flusher_running) {
+        __atomic_store_n(&LR.flusher_stop, true, __ATOMIC_RELEASE);
+        pthread_join(LR.flusher, NULL);
+        LR.flusher_running = false;
+    }
+    logFlush();
+    if (LR.dropped && LR.fd != -1) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "[WARN] %llu messages dropped\n",
+                           LR.dropped);
+        write(LR.fd, buf, len);
+    }
+    if (LR.fd != -1) close(LR.fd);
+    LR.fd = -1;
+}
+
 //== == == == == == == == == == == == == == == == == == == == == == == == ==
 
 /*** terminal ***/
@@ -103,36 +578,117 @@ void editorAppendClrToBuf(struct writeBuf *wBuf, int code, int r, int g, int b);
 // realocate new memory for additional characters to append of size appendLen to
 // buffer wBuf
 void bufAppend(struct writeBuf *wBuf, const char *appendSrc, int appendLen) {
-    char *newBuf = realloc(wBuf->pointer, wBuf->len + appendLen);
-    if (newBuf == NULL) {
-        return;  // reallocation failed. original buffer still intact.
+    if (appendLen <= 0) return;  // realloc to 0 bytes would free the buffer
+    if (wBuf->len + appendLen > wBuf->cap) {
+        // grow by half again, so a frame built from small pieces is not
+        // reallocated for every one of them
+        int cap = wBuf->cap + wBuf->cap / 2;
+        if (cap < wBuf->len + appendLen) cap = wBuf->len + appendLen;
+        if (cap < 256) cap = 256;
+        char *newBuf = realloc(wBuf->pointer, cap);
+        if (newBuf == NULL) {
+            return;  // reallocation failed. original buffer still intact.
+        }
+        wBuf->pointer = newBuf;
+        wBuf->cap = cap;
     }
-    memcpy(&newBuf[wBuf->len], appendSrc, appendLen);
-    wBuf->pointer = newBuf;
+    memcpy(&wBuf->pointer[wBuf->len], appendSrc, appendLen);
     wBuf->len += appendLen;
 }
 
 // dealocate memory using free function from stdlib
 void bufFree(struct writeBuf *wBuf) { free(wBuf->pointer); }
 
-int editorRowCxtoRx(erow *row, int cx) {
-    int rx = 0;
-    for (int j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (TTE_TAB_STOP - 1) - (rx % TTE_TAB_STOP);
+// monotonic clock in nanoseconds, used for timing measurements
+long long monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifdef TTE_BENCH
+// hand out the next byte of the keystroke script. Once the script is used up
+// an escape is returned so any open prompt gets cancelled.
+int benchRead(char *c) {
+    if (BT.keys_pos >= BT.keys_len) {
+        *c = '\x1b';
+        return 1;
+    }
+    *c = BT.keys[BT.keys_pos++];
+    return 1;
+}
+
+// count the bytes of a frame instead of sending them to a terminal
+int benchWrite(const char *buf, int len) {
+    (void)buf;
+    BT.frames++;
+    BT.out_bytes += len;
+    if (len > BT.max_frame_bytes) BT.max_frame_bytes = len;
+    return len;
+}
+
+// record the time taken since the previous key was requested, i.e. the time
+// spent processing that key and drawing the frames that followed it.
+void benchMarkKey() {
+    long long now = monotonicNs();
+    if (BT.last_key) {
+        if (BT.lat_len == BT.lat_cap) {
+            BT.lat_cap = BT.lat_cap ? BT.lat_cap * 2 : 1024;
+            BT.lat = realloc(BT.lat, sizeof(long long) * BT.lat_cap);
         }
-        rx++;
+        BT.lat[BT.lat_len++] = now - BT.last_key;
     }
-    return rx;
+    BT.last_key = now;
+}
+#endif
+
+// read a single byte of input. Headless builds take it from the replayed
+// keystroke script instead of the terminal.
+int ttyRead(char *c) {
+#ifdef TTE_BENCH
+    return benchRead(c);
+#else
+    int bytes_read = read(STDIN_FILENO, c, 1);
+    if (bytes_read == 1 && ttyRecordFd != -1) write(ttyRecordFd, c, 1);
+    return bytes_read;
+#endif
+}
+
+// write to the terminal, or to the byte counter of the virtual terminal.
+int ttyWrite(const char *buf, int len) {
+#ifdef TTE_BENCH
+    return benchWrite(buf, len);
+#else
+    return write(STDOUT_FILENO, buf, len);
+#endif
+}
+
+// true if a key is waiting to be read
+bool ttyInputPending() {
+#ifdef TTE_BENCH
+    return BT.keys_pos < BT.keys_len;
+#else
+    if (batchMode) return false;  // no terminal to read keys from
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, 0) > 0;
+#endif
 }
 
 // Error printing before exiting
 void die(const char *msg) {
+    if (batchMode) {
+        // no screen to restore and no Log.txt left in the caller's directory
+        int error = errno;
+        fprintf(stderr, "%s: %s: %s\n", EC.filename ? EC.filename : "tte",
+                msg, strerror(error));
+        exit(EXIT_FAILURE);
+    }
     editorClearScreen();
     //  prints the error message msg and errno.
     perror(msg);
-    debugFileLog();
-    bufFree(&dLog);
+    lineCacheJoinWriters();
+    perfDump();
+    logClose();
     exit(EXIT_FAILURE);
 }
 
@@ -177,49 +733,31 @@ void enableRawMode() {
     }
 }
 
-void debugFormat(char *fmt, ...) {
-    char buf[128];
-    va_list p;
-    va_start(p, fmt);
-    int len = vsnprintf(buf, sizeof(buf), fmt, p);
-    bufAppend(&dLog, buf, len);
-    va_end(p);
-}
-
-void debugMsg(char *msg) {
-    char buf[32];
-    int len = sprintf(buf, "%s\n", msg);
-    bufAppend(&dLog, buf, len);
-}
-
-void debugNumber(int num) {
-    char buf[32];
-    int len = sprintf(buf, "%d\n", num);
-    bufAppend(&dLog, buf, len);
-}
-
 int editorReadKey() {
+#ifdef TTE_BENCH
+    benchMarkKey();
+#endif
     char char_read;
-    int bytes_read = read(STDIN_FILENO, &char_read, 1);  // Read the first byte
+    int bytes_read = ttyRead(&char_read);  // Read the first byte
     while (bytes_read != 1) {
         if (bytes_read == -1) {
             die("read");  // Program Ends, Error Handling Section
         }
-        bytes_read = read(STDIN_FILENO, &char_read,
-                          1);  // Read Again because nothing read
+        if (editorIdle()) editorRefreshScreen();
+        bytes_read = ttyRead(&char_read);  // Read Again because nothing read
     }
 
     if (char_read == '\x1b') {  // if first byte is escape character
         char seq[3];
 
         // Read 2 more bytes
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (ttyRead(&seq[0]) != 1) return '\x1b';
+        if (ttyRead(&seq[1]) != 1) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {  // if seq[1] is a number
                 // Read another character
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (ttyRead(&seq[2]) != 1) return '\x1b';
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '3':
@@ -249,10 +787,15 @@ int editorReadKey() {
         }
         return '\x1b';
     }
-    return char_read;
+    return (unsigned char)char_read;
 }
 
 int getWindowSize(int *rows, int *cols) {
+#ifdef TTE_BENCH
+    *rows = BT.rows;
+    *cols = BT.cols;
+    return 0;
+#endif
     struct winsize ws;
 
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 ||
@@ -267,788 +810,5776 @@ int getWindowSize(int *rows, int *cols) {
 
 //== == == == == == == == == == == == == == == == == == == == == == == ==
 //==
-/*** row operations ***/
-void expandBuffer() {
-    int newSize = (EC.rows_cap == 0) ? 1 : (EC.rows_cap * 2);
-    EC.row = realloc(EC.row, sizeof(erow) * newSize);
-    EC.rows_cap = newSize;
-}
-
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (TTE_TAB_STOP - 1) - (cur_rx % TTE_TAB_STOP);
-        cur_rx++;
-        if (cur_rx > rx) return cx;
-    }
-    return cx;
-}
-
-void editorUpdateRenderRow(erow *row) {
-    int tabs = 0;
-    for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') tabs++;
-    }
-
-    free(row->render);
-    row->render = malloc(row->size + tabs * (TTE_TAB_STOP - 1) + 1);
-    int idx = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TTE_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
-    }
+/*** instrumentation ***/
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+int perfBucket(unsigned long long value) {
+    if (value < 16) return value;
+    int exp = 63 - __builtin_clzll(value);
+    int index = 16 + (exp - 4) * 8 + ((value >> (exp - 3)) & 7);
+    return index < PERF_BUCKETS ? index : PERF_BUCKETS - 1;
 }
 
-void editorInsertRow(char *data, size_t len, int insertAt) {
-    if (insertAt < 0 || insertAt > EC.data_rows) return;
-    EC.row = realloc(EC.row, sizeof(erow) * (EC.data_rows + 1));
-    memmove(&EC.row[insertAt + 1], &EC.row[insertAt],
-            sizeof(erow) * (EC.data_rows - insertAt));
-
-    if (EC.data_rows >= EC.rows_cap) {
-        expandBuffer();
-    }
-
-    EC.row[insertAt].size = len;
-    EC.row[insertAt].chars = malloc(len + 1);
-    memcpy(EC.row[insertAt].chars, data, len);
-    EC.row[insertAt].chars[len] = '\0';
-    EC.data_rows++;
-
-    if (EC.max_data_cols < len) {
-        EC.max_data_cols = len;
-    }
-
-    EC.row[insertAt].rsize = 0;
-    EC.row[insertAt].render = NULL;
-    editorUpdateRenderRow(&EC.row[insertAt]);
-    EC.dirty = true;
+// smallest value that falls into bucket index
+unsigned long long perfBucketValue(int index) {
+    if (index < 16) return index;
+    int exp = (index - 16) / 8 + 4;
+    return (8ULL + (index - 16) % 8) << (exp - 3);
 }
 
-void editorRowInsertChar(erow *row, int insertAt, int c) {
-    if (insertAt < 0 || insertAt > row->size) insertAt = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[insertAt + 1], &row->chars[insertAt],
-            row->size - insertAt + 1);
-    row->size++;
-    row->chars[insertAt] = c;
-    editorUpdateRenderRow(row);
-    EC.dirty = true;
+void perfRecord(struct perfHist *hist, unsigned long long value) {
+    hist->bucket[perfBucket(value)]++;
+    hist->count++;
+    hist->sum += value;
 }
 
-void editorRowDelChar(erow *row, int delAt) {
-    if (delAt < 0 || delAt > row->size) return;
-    memmove(&row->chars[delAt], &row->chars[delAt + 1], row->size - delAt);
-    row->size--;
-    editorUpdateRenderRow(row);
-    EC.dirty = true;
+unsigned long long perfPercentile(struct perfHist *hist, double q) {
+    unsigned long long target = q * hist->count;
+    unsigned long long seen = 0;
+    for (int i = 0; i < PERF_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen > target) return perfBucketValue(i);
+    }
+    return 0;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    row->render = NULL;
-    row->chars = NULL;
+// short summary of the frame timings for the status bar
+int perfOverlay(char *buf, int size) {
+    struct perfHist *frame = &PS.hist[PERF_FRAME];
+    struct perfHist *bytes = &PS.hist[PERF_BYTES];
+    return snprintf(buf, size, "frame p50 %lluus p99 %lluus %lluB  ",
+                    perfPercentile(frame, 0.5), perfPercentile(frame, 0.99),
+                    bytes->count ? bytes->sum / bytes->count : 0);
 }
 
-void editorDelRow(int rowIndex) {
-    if (rowIndex < 0 || rowIndex >= EC.data_rows) return;
-    editorFreeRow(&EC.row[rowIndex]);
-    memmove(&EC.row[rowIndex], &EC.row[rowIndex + 1],
-            sizeof(erow) * (EC.data_rows - rowIndex - 1));
-    EC.data_rows--;
-    EC.dirty = true;
+void perfToggleOverlay() {
+    PS.overlay = !PS.overlay;
+    if (PS.overlay) PS.enabled = true;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRenderRow(row);
-    EC.dirty = true;
+// write the collected histograms to the log
+void perfDump() {
+    static const char *names[PERF_STAGES] = {"key",   "scroll", "draw",
+                                             "write", "frame",  "bytes"};
+    if (!PS.enabled) return;
+    LR.keep = true;  // asked for with TTE_PERF or Ctrl-T
+    logInfo("%-8s %10s %10s %10s %10s %10s", "stage", "count", "avg",
+                "p50", "p99", "max");
+    for (int i = 0; i < PERF_STAGES; i++) {
+        struct perfHist *hist = &PS.hist[i];
+        if (!hist->count) continue;
+        unsigned long long max = 0;
+        for (int b = PERF_BUCKETS - 1; b >= 0; b--) {
+            if (hist->bucket[b]) {
+                max = perfBucketValue(b);
+                break;
+            }
+        }
+        logInfo("%-8s %10llu %10llu %10llu %10llu %10llu", names[i],
+                    hist->count, hist->sum / hist->count,
+                    perfPercentile(hist, 0.5), perfPercentile(hist, 0.99), max);
+    }
 }
 
 //== == == == == == == == == == == == == == == == == == == == == == == ==
 //==
-/*** editor operations ***/
-void editorInsertChar(int c) {
-    if (EC.cy == EC.data_rows) {
-        editorInsertRow("", 0, EC.data_rows);
+/*** unicode ***/
+
+// true when none of the len bytes at s has the high bit set. Checks 64 bytes
+// per step with SSE2 where available, 8 at a time otherwise, so ASCII text
+// costs next to nothing to classify.
+bool utf8IsAscii(const char *s, int len) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(s + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(any)) return false;
     }
-    editorRowInsertChar(&EC.row[EC.cy], EC.cx, c);
-    EC.cx++;
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, s + i, sizeof(word));
+        if (word & 0x8080808080808080ULL) return false;
+    }
+    for (; i < len; i++) {
+        if (s[i] & 0x80) return false;
+    }
+    return true;
 }
 
-void editorDelChar() {
-    if (EC.cy == EC.data_rows) return;
-    if (EC.cx == 0 && EC.cy == 0) return;
-    erow *row = &EC.row[EC.cy];
-    if (EC.cx > 0) {
-        editorRowDelChar(row, EC.cx - 1);
-        EC.cx--;
+// decode the code point starting at s into *cp and return its length in
+// bytes. Malformed or truncated sequences decode as U+FFFD, one byte long.
+int utf8Decode(const char *s, int len, int *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    int n;
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if ((u[0] & 0xE0) == 0xC0) {
+        n = 2;
+        *cp = u[0] & 0x1F;
+    } else if ((u[0] & 0xF0) == 0xE0) {
+        n = 3;
+        *cp = u[0] & 0x0F;
+    } else if ((u[0] & 0xF8) == 0xF0) {
+        n = 4;
+        *cp = u[0] & 0x07;
     } else {
-        EC.cx = EC.row[EC.cy - 1].size;
-        editorRowAppendString(&EC.row[EC.cy - 1], row->chars, row->size);
-        editorDelRow(EC.cy);
-        EC.cy--;
+        *cp = 0xFFFD;
+        return 1;
+    }
+    if (n > len) {
+        *cp = 0xFFFD;
+        return 1;
+    }
+    for (int i = 1; i < n; i++) {
+        if ((u[i] & 0xC0) != 0x80) {
+            *cp = 0xFFFD;
+            return 1;
+        }
+        *cp = (*cp << 6) | (u[i] & 0x3F);
     }
+    return n;
 }
 
-void editorInsertNewline() {
-    if (EC.cx == 0) {
-        editorInsertRow("", 0, EC.cy);
-    } else {
-        erow *row = &EC.row[EC.cy];
-        editorInsertRow(&row->chars[EC.cx], row->size - EC.cx, EC.cy + 1);
-        row = &EC.row[EC.cy];
-        row->size = EC.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRenderRow(row);
+bool utf8IsContinuation(char c) { return (c & 0xC0) == 0x80; }
+
+// number of terminal columns code point cp takes up
+int utf8Width(int cp) {
+    // combining marks and zero width characters
+    if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x200B && cp <= 0x200F) ||
+        (cp >= 0xFE00 && cp <= 0xFE0F) || (cp >= 0x20D0 && cp <= 0x20FF))
+        return 0;
+    // east asian wide and fullwidth ranges, and emoji
+    if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0x303E) ||
+        (cp >= 0x3041 && cp <= 0x33FF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+        (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xA000 && cp <= 0xA4CF) ||
+        (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+        (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+        (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+        (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD))
+        return 2;
+    return 1;
+}
+
+// decode the character at s and return its length, its column width in *width
+int utf8Next(const char *s, int len, int *width) {
+    if ((unsigned char)s[0] < 0x80) {
+        *width = 1;
+        return 1;
     }
-    EC.cy++;
-    EC.cx = 0;
+    int cp;
+    int n = utf8Decode(s, len, &cp);
+    *width = utf8Width(cp);
+    return n;
 }
 
 //== == == == == == == == == == == == == == == == == == == == == == == ==
 //==
-/*** file i/o ***/
+/*** memory ***/
 
-bool fileExists(char *filename) {
-    if (filename == NULL) return false;
+struct arenaBlock *arenaNewBlock(struct rowArena *arena, size_t cap) {
+    struct arenaBlock *block = malloc(sizeof(struct arenaBlock) + cap);
+    if (block == NULL) die("arenaNewBlock");
+    block->used = 0;
+    block->cap = cap;
+    arena->reserved += sizeof(struct arenaBlock) + cap;
+    return block;
+}
 
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1 && errno == ENOENT) {
-        return false;
-    }
-    close(fd);
-    return true;
+// size of class index: 8 << (index / 2), times 1.5 for odd indexes
+size_t arenaClassSize(int index) {
+    size_t size = (size_t)8 << (index / 2);
+    return index % 2 ? size + size / 2 : size;
 }
 
-void editorOpen(char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+// largest class whose size fits in size bytes, -1 if it is below 8
+int arenaClassFloor(size_t size) {
+    if (size < 8) return -1;
+    int exp = 63 - __builtin_clzll(size);
+    int index = 2 * (exp - 3);
+    if (size >= ((size_t)3 << (exp - 1))) index++;
+    return index < ARENA_CLASSES ? index : ARENA_CLASSES - 1;
+}
 
-    free(EC.filename);
-    EC.filename = strdup(filename);
+// smallest class that holds size bytes
+int arenaClassCeil(size_t size) {
+    int index = arenaClassFloor(size);
+    if (index < 0) return 0;
+    return arenaClassSize(index) < size ? index + 1 : index;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    size_t linelen;
-    linelen = getline(&line, &linecap, fp);
+// hand the uncarved end of a block that is being retired to the free lists
+void arenaReleaseTail(struct rowArena *arena, struct arenaBlock *block) {
+    size_t left = block->cap - block->used;
+    int index = arenaClassFloor(left);
+    if (index < 0) return;
+    char *chunk = &block->data[block->used];
+    block->used = block->cap;
+    memcpy(chunk, &arena->free_list[index], sizeof(char *));
+    arena->free_list[index] = chunk;
+    arena->free_bytes += arenaClassSize(index);
+}
 
-    while (linelen != (size_t)-1) {
-        while (linelen > 0 &&
-               (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-            linelen--;
+// allocate at least size bytes, *granted receives how many are usable
+void *arenaAlloc(struct rowArena *arena, size_t size, int *granted) {
+    if (size <= ARENA_MAX_CLASS_SIZE) {
+        int index = arenaClassCeil(size);
+        char *chunk = arena->free_list[index];
+        if (chunk) {
+            memcpy(&arena->free_list[index], chunk, sizeof(char *));
+            *granted = arenaClassSize(index);
+            arena->free_bytes -= *granted;
+            arena->live += *granted;
+            return chunk;
         }
-
-        editorInsertRow(line, linelen, EC.data_rows);
-
-        linelen = getline(&line, &linecap, fp);
     }
 
-    free(line);
-    fclose(fp);
-    EC.dirty = false;
+    *granted = size;
+    arena->live += size;
+    struct arenaBlock *head = arena->blocks;
+    if (head && head->cap - head->used >= size) {
+        void *p = &head->data[head->used];
+        head->used += size;
+        return p;
+    }
+    struct arenaBlock *block;
+    if (size > ARENA_MAX_CLASS_SIZE) {
+        // keep carving the current block, the big one sits behind it
+        block = arenaNewBlock(arena, size);
+        if (head) {
+            block->next = head->next;
+            head->next = block;
+        } else {
+            block->next = NULL;
+            arena->blocks = block;
+        }
+    } else {
+        if (head) arenaReleaseTail(arena, head);
+        block = arenaNewBlock(arena, ARENA_BLOCK_SIZE);
+        block->next = head;
+        arena->blocks = block;
+    }
+    block->used = size;
+    return block->data;
 }
 
-void debugFileLog() {
-    if (!dLog.len) {
+// give back an allocation of size bytes for reuse
+void arenaRelease(struct rowArena *arena, void *p, size_t size) {
+    struct arenaBlock *head = arena->blocks;
+    if (p == NULL) return;
+    arena->live -= size;
+    if (head && (char *)p + size == &head->data[head->used]) {
+        head->used -= size;
         return;
     }
-    FILE *fp = fopen("Log.txt", "w");
-    if (!fp) die("dFileLog");
-
-    fprintf(fp, "%s", dLog.pointer);
-
-    fclose(fp);
+    if (size > ARENA_MAX_CLASS_SIZE) {
+        // a block of its own, unless it grew in place at the end of one
+        for (struct arenaBlock **link = &arena->blocks; *link;
+             link = &(*link)->next) {
+            if ((*link)->data == p && (*link)->cap == size) {
+                struct arenaBlock *block = *link;
+                *link = block->next;
+                arena->reserved -= sizeof(struct arenaBlock) + block->cap;
+                free(block);
+                return;
+            }
+        }
+    }
+    int index = arenaClassFloor(size);
+    if (index < 0) return;  // too small to hold a free list link
+    memcpy(p, &arena->free_list[index], sizeof(char *));
+    arena->free_list[index] = p;
+    arena->free_bytes += arenaClassSize(index);
 }
 
-char *editorRowsToString(int *buflen) {
-    int totalLen = 0;
-    for (int rowIndex = 0; rowIndex < EC.data_rows; rowIndex++)
-        totalLen += EC.row[rowIndex].size + 1;
-
-    *buflen = totalLen;
-
-    char *outBuf = malloc(totalLen);
-    char *rowPtr = outBuf;
-
-    for (int rowIndex = 0; rowIndex < EC.data_rows; rowIndex++) {
-        memcpy(rowPtr, EC.row[rowIndex].chars, EC.row[rowIndex].size);
-        rowPtr += EC.row[rowIndex].size;
-        *rowPtr = '\n';
-        rowPtr++;
+// resize an allocation, in place when it is the last one in the current
+// block. *granted receives the new usable size.
+void *arenaGrow(struct rowArena *arena, void *p, size_t oldSize,
+                size_t newSize, int *granted) {
+    struct arenaBlock *head = arena->blocks;
+    if (p && head && (char *)p + oldSize == &head->data[head->used] &&
+        head->used - oldSize + newSize <= head->cap) {
+        head->used += newSize - oldSize;
+        arena->live += newSize - oldSize;
+        *granted = newSize;
+        return p;
     }
-    rowPtr = NULL;
-    return outBuf;
+    void *newP = arenaAlloc(arena, newSize, granted);
+    if (p) {
+        memcpy(newP, p, oldSize < newSize ? oldSize : newSize);
+        arenaRelease(arena, p, oldSize);
+    }
+    return newP;
 }
 
-void editorSave() {
-    if (EC.filename == NULL) {
-        EC.filename = editorPrompt("save as:%s", NULL);
-        if (EC.filename == NULL) {
-            editorSetStatusMsg("save aborted");
-            return;
-        }
+void arenaFreeAll(struct rowArena *arena) {
+    struct arenaBlock *block = arena->blocks;
+    while (block) {
+        struct arenaBlock *next = block->next;
+        free(block);
+        block = next;
     }
+    memset(arena, 0, sizeof(*arena));
+}
 
-    if (fileExists(EC.filename)) {
-        char *response;
-        response = editorPrompt(
-            "File already exists. overwrite? Enter [Y]es or [N]o?%s", NULL);
-        if (response == NULL || (response[0] != 'y' && response[0] != 'Y')) {
-            editorSetStatusMsg("save aborted");
-            free(EC.filename);
-            EC.filename = NULL;
-            return;
-        }
-    }
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** cold rows ***/
 
-    int len;
-    char *buf = editorRowsToString(&len);
+// With TTE_COMPRESS set, rows away from the view are frozen while the
+// editor is idle: runs of them are packed into blocks of about
+// TTE_COLD_BLOCK bytes of text, compressed, and their chars and render are
+// freed. Drawing and cursor movement only look at the rows around the
+// view, which editorScroll thaws before every frame. Search and save read
+// rows through editorRowChars, which decompresses the block of a frozen row
+// into a small cache of recently used blocks. Commands that rewrite rows in
+// bulk and multiple cursors thaw the whole buffer first.
 
-    int fd = open(EC.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                editorSetStatusMsg("%d bytes written to disk. File is saved!",
-                                   len);
-                EC.dirty = false;
-                return;
-            }
+// Blocks are compressed with a byte oriented LZ77 in the style of LZ4. A
+// sequence is a token byte holding the number of literals in its high and
+// the match length minus LZ_MIN_MATCH in its low four bits, where 15 means
+// more length bytes follow, each adding up to 255. The literals come next,
+// then the match as a two byte offset back into the output. The last
+// sequence of a block has literals only.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
+#define LZ_SLACK 16  // bytes past its end the decoder may scribble on
+#define lzBound(len) ((len) + (len) / 255 + 16)
+
+// write the rest of a length that did not fit in a token nibble
+unsigned char *lzPutLength(unsigned char *out, int len) {
+    for (; len >= 255; len -= 255) *out++ = 255;
+    *out++ = len;
+    return out;
+}
+
+unsigned char *lzPutSequence(unsigned char *out, const unsigned char *lit,
+                             int litLen, int offset, int matchLen) {
+    int extra = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    *out++ = (litLen < 15 ? litLen : 15) << 4 | (extra < 15 ? extra : 15);
+    if (litLen >= 15) out = lzPutLength(out, litLen - 15);
+    memcpy(out, lit, litLen);
+    out += litLen;
+    if (matchLen == 0) return out;
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (extra >= 15) out = lzPutLength(out, extra - 15);
+    return out;
+}
+
+// compress len bytes of src into dst, which has room for lzBound(len)
+// bytes. Returns the compressed size.
+int lzCompress(const char *src, int len, char *dst) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    int table[1 << LZ_HASH_BITS];  // last position + 1 of each 4 byte hash
+    memset(table, 0, sizeof(table));
+    int anchor = 0;  // first byte not written out yet
+    int pos = 0;
+    while (pos + LZ_MIN_MATCH <= len) {
+        uint32_t word;
+        memcpy(&word, &in[pos], sizeof(word));
+        int slot = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = table[slot] - 1;
+        table[slot] = pos + 1;
+        if (cand < 0 || pos - cand > 0xffff ||
+            memcmp(&in[cand], &in[pos], LZ_MIN_MATCH) != 0) {
+            pos++;
+            continue;
         }
-        close(fd);
+        int matchLen = LZ_MIN_MATCH;
+        while (pos + matchLen < len && in[cand + matchLen] == in[pos + matchLen])
+            matchLen++;
+        out = lzPutSequence(out, &in[anchor], pos - anchor, pos - cand,
+                            matchLen);
+        pos += matchLen;
+        anchor = pos;
     }
-    free(buf);
-    editorSetStatusMsg("Saving Failed! ERROR: %s", strerror(errno));
+    out = lzPutSequence(out, &in[anchor], len - anchor, 0, 0);
+    return out - (unsigned char *)dst;
 }
 
-//== == == == == == == == == == == == == == == == == == == == == == == ==
-//==
+// add the length bytes following a token nibble of 15 to *len
+bool lzGetLength(const unsigned char **in, const unsigned char *end,
+                 int *len) {
+    int byte;
+    do {
+        if (*in == end) return false;
+        byte = *(*in)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
 
-char *editorFindCallbackRowSearch(int *currRow, int lastMatchRow, int direction,
-                                  char *buf) {
-    erow *row = &EC.row[*currRow];
-    int colIndex = lastMatchRow == *currRow ? editorRowCxtoRx(row, EC.cx) : 0;
-    char *match = NULL;
-    if (colIndex >= row->rsize) {
-        *currRow += direction;
-        return match;
-    }
-    if (direction == 1) {
-        if (lastMatchRow == *currRow) colIndex++;
-        if (colIndex >= row->rsize || colIndex < 0) return match;
-        match = strstr(&row->render[colIndex], buf);
-    } else {
-        if (lastMatchRow != *currRow) colIndex = row->rsize - 1;
-        int tempIndex = 0;
-        char *prevMatch = NULL;
-        debugNumber(tempIndex);
-        while (true) {
-            if (tempIndex >= row->rsize || tempIndex < 0) break;
-            match = strstr(&row->render[tempIndex], buf);
-            if (match && match < &row->render[colIndex]) {
-                prevMatch = match;
-                tempIndex = match - row->render + 1;
-            } else {
-                break;
-            }
+// decompress len bytes of src into dst, which has LZ_SLACK bytes of room
+// after dstLen so short copies can be done in whole words. Returns false
+// unless src is a valid block of exactly dstLen bytes.
+bool lzDecompress(const char *src, int len, char *dst, int dstLen) {
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + len;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned char *outEnd = out + dstLen;
+    while (in < end) {
+        int token = *in++;
+        int litLen = token >> 4;
+        if (litLen == 15 && !lzGetLength(&in, end, &litLen)) return false;
+        if (litLen > end - in || litLen > outEnd - out) return false;
+        if (litLen <= 16 && end - in >= 16)
+            memcpy(out, in, 16);
+        else
+            memcpy(out, in, litLen);
+        out += litLen;
+        in += litLen;
+        if (in == end) break;
+
+        if (end - in < 2) return false;
+        int offset = in[0] | in[1] << 8;
+        in += 2;
+        int matchLen = token & 15;
+        if (matchLen == 15 && !lzGetLength(&in, end, &matchLen)) return false;
+        matchLen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out - (unsigned char *)dst ||
+            matchLen > outEnd - out) {
+            return false;
         }
-        if (prevMatch) {
-            match = prevMatch;
+        const unsigned char *from = out - offset;
+        if (offset >= 16 && matchLen <= 16) {
+            memcpy(out, from, 16);
+            out += matchLen;
+        } else if (offset >= 8) {
+            for (int i = 0; i < matchLen; i += 8) memcpy(out + i, from + i, 8);
+            out += matchLen;
         } else {
-            match = NULL;
+            while (matchLen--) *out++ = *from++;  // overlapping run
         }
     }
-    return match;
+    return out == outEnd;
 }
 
-void editorFindCallback(char *buf, int c) {
-    static int last_match = -1;
-    static int direction = 1;
-
-    if (c == ARROW_DOWN || c == ARROW_RIGHT) {
-        direction = 1;
-    } else if (c == ARROW_LEFT || c == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
-        if (c == '\r' || c == '\x1b') {
-            return;
-        }
-    }
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    if (current == -1 && direction == 1) current += direction;
+void coldCacheUnlink(struct coldBlock *block) {
+    if (block->lru_prev)
+        block->lru_prev->lru_next = block->lru_next;
+    else
+        CC.head = block->lru_next;
+    if (block->lru_next)
+        block->lru_next->lru_prev = block->lru_prev;
+    else
+        CC.tail = block->lru_prev;
+    block->lru_prev = block->lru_next = NULL;
+}
 
-    for (int loopNum = 0; loopNum < EC.data_rows; loopNum++) {
-        if (current == EC.data_rows)
-            current = 0;
-        else if (current == -1)
-            current = EC.data_rows - 1;
+void coldCachePush(struct coldBlock *block) {
+    block->lru_next = CC.head;
+    if (CC.head) CC.head->lru_prev = block;
+    CC.head = block;
+    if (CC.tail == NULL) CC.tail = block;
+}
 
-        char *match =
-            editorFindCallbackRowSearch(&current, last_match, direction, buf);
+// drop the decompressed text of block
+void coldCacheRemove(struct coldBlock *block) {
+    if (block->text == NULL) return;
+    coldCacheUnlink(block);
+    free(block->text);
+    block->text = NULL;
+    CC.len--;
+    CC.bytes -= block->text_len;
+}
 
-        if (match) {
-            last_match = current;
-            EC.cy = current;
-            EC.cx = editorRowRxToCx(&EC.row[current],
-                                    match - EC.row[current].render);
-            // EC.rowoff = EC.data_rows;
-            current += direction;
-            break;
+// decompressed text of block, cached as the most recently used one
+const char *coldBlockText(struct coldBlock *block) {
+    if (block->text) {
+        if (CC.head != block) {
+            coldCacheUnlink(block);
+            coldCachePush(block);
         }
-        current += direction;
+        return block->text;
     }
+    if (CC.len == TTE_COLD_CACHE) coldCacheRemove(CC.tail);
+    block->text = malloc(block->text_len + LZ_SLACK);
+    if (block->text == NULL) die("coldBlockText");
+    if (!lzDecompress(block->data, block->len, block->text, block->text_len))
+        die("corrupt cold block");
+    coldCachePush(block);
+    CC.len++;
+    CC.bytes += block->text_len;
+    return block->text;
 }
 
-void editorFind() {
-    int saved_cx = EC.cx;
-    int saved_cy = EC.cy;
-    char *query =
-        editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
-    if (query) {
-        free(query);
-    } else {
-        EC.cx = saved_cx;
-        EC.cy = saved_cy;
-    }
+// forget a reference of a frozen row to block, freeing it with the last
+void coldBlockRelease(struct coldBlock *block) {
+    if (--block->refs > 0) return;
+    coldCacheRemove(block);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        EC.cold = block->next;
+    if (block->next) block->next->prev = block->prev;
+    EC.cold_bytes -= sizeof(struct coldBlock) + block->len;
+    free(block);
 }
-//== == == == == == == == == == == == == == == == == == == == == ==
-//== == ==
-/*** output ***/
-void clearLineRight(struct writeBuf *wBuf) { bufAppend(wBuf, "\x1b[K", 3); }
 
-void printWelcomeMsg(struct writeBuf *wBuf) {
-    char welcome[80];
-    int welcomelen =
-        snprintf(welcome, sizeof(welcome), "Terminal Text editor -- version %s",
-                 TTE_VERSION);
-    if (welcomelen > EC.screen_cols) {
-        welcomelen = EC.screen_cols;
-    }
-    int padding = (EC.screen_cols - welcomelen) / 2;
-    if (padding) {
-        bufAppend(wBuf, "~", 1);
-        padding--;
+// free every block of the current buffer
+void editorFreeColdBlocks() {
+    while (EC.cold) {
+        struct coldBlock *block = EC.cold;
+        EC.cold = block->next;
+        coldCacheRemove(block);
+        free(block);
     }
-    while (padding--) bufAppend(wBuf, " ", 1);
-    bufAppend(wBuf, welcome, welcomelen);
+    EC.cold_bytes = 0;
 }
 
-void editorDrawStatusBar(struct writeBuf *wBuf) {
-    // Invert Foreground and background color for status bar
-    editorAppendClrToBuf(wBuf, INVERT_FG_BG, 0, 0, 0);
+// Chars of row for reading, also when it is frozen. The text of a frozen
+// row stays valid until more than TTE_COLD_CACHE other blocks are read.
+const char *editorRowChars(erow *row) {
+    if (row->cold == NULL) return row->chars;
+    return coldBlockText(row->cold) + row->cap;
+}
 
-    int totalCols = EC.screen_cols + TTE_SIDE_PANEL_WIDTH;
-    const int LINE_NUM_LEN = 9;
-    char *status = malloc(totalCols + 1);
+// give a frozen row its own chars again
+void editorRowThaw(erow *row) {
+    if (row->cold == NULL) return;
+    struct coldBlock *block = row->cold;
+    const char *chars = coldBlockText(block) + row->cap;
+    row->chars = arenaAlloc(&EC.text, row->size + 1, &row->cap);
+    memcpy(row->chars, chars, row->size + 1);
+    row->cold = NULL;
+    row->render = NULL;  // rebuilt when it is drawn
+    row->rcap = 0;
+    EC.warm_rows++;
+    coldBlockRelease(block);
+}
 
-    const char *dirty = EC.dirty ? "*" : " ";
-    const char *fileName = EC.filename ? EC.filename : "[NO Name]";
-    const char *longFNDots =
-        (EC.filename && strlen(EC.filename) > TTE_MAX_FILENAME_DISPLAYED)
-            ? "..."
-            : "";
+void editorThawRows(int first, int last) {
+    if (EC.cold == NULL) return;
+    if (first < 0) first = 0;
+    if (last > EC.data_rows) last = EC.data_rows;
+    for (int i = first; i < last; i++) editorRowThaw(&EC.row[i]);
+}
 
-    // Limit FileNameLen to 20 characters.
-    int fileNameLen = strlen(fileName);
-    fileNameLen = fileNameLen > TTE_MAX_FILENAME_DISPLAYED
-                      ? TTE_MAX_FILENAME_DISPLAYED - 3
-                      : fileNameLen;
+// thaw every row before something that may change any of them
+void editorThawAll() { editorThawRows(0, EC.data_rows); }
 
-    int len = strlen(dirty) + fileNameLen + strlen(longFNDots);
-    int spaces = totalCols - LINE_NUM_LEN - len;
+// freeze rows [first, last), which are all warm, into a new block
+void editorFreezeRun(int first, int last) {
+    int textLen = 0;
+    for (int i = first; i < last; i++) textLen += EC.row[i].size + 1;
+    char *text = malloc(textLen);
+    char *packed = malloc(lzBound(textLen));
+    if (text == NULL || packed == NULL) die("editorFreezeRun");
+    int offset = 0;
+    for (int i = first; i < last; i++) {
+        memcpy(&text[offset], EC.row[i].chars, EC.row[i].size + 1);
+        offset += EC.row[i].size + 1;
+    }
+    int len = lzCompress(text, textLen, packed);
 
-    len = snprintf(status, totalCols + 1, "%s%*s%.03s%*s<%3d:%-3d ", dirty,
-                   fileNameLen, fileName, longFNDots, spaces, "", EC.cy + 1,
-                   EC.rx + 1);
+    struct coldBlock *block = malloc(sizeof(struct coldBlock) + len);
+    if (block == NULL) die("editorFreezeRun");
+    memcpy(block->data, packed, len);
+    block->len = len;
+    block->text = NULL;
+    block->text_len = textLen;
+    block->refs = last - first;
+    block->lru_prev = block->lru_next = NULL;
+    block->prev = NULL;
+    block->next = EC.cold;
+    if (EC.cold) EC.cold->prev = block;
+    EC.cold = block;
+    EC.cold_bytes += sizeof(struct coldBlock) + len;
+    free(text);
+    free(packed);
 
-    bufAppend(wBuf, status, len);
-    // Reset all graphical rendering settings to default.
-    editorAppendClrToBuf(wBuf, RESET, 0, 0, 0);
-    bufAppend(wBuf, "\r\n", 2);
+    offset = 0;
+    for (int i = first; i < last; i++) {
+        erow *row = &EC.row[i];
+        if (row->rcap && row->epoch == EC.render_epoch) {
+            arenaRelease(&EC.render, row->render, row->rcap);
+        }
+        arenaRelease(&EC.text, row->chars, row->cap);
+        row->chars = NULL;
+        row->render = NULL;
+        row->rcap = 0;
+        row->cold = block;
+        row->cap = offset;
+        offset += row->size + 1;
+    }
+    EC.warm_rows -= last - first;
 }
 
-void editorDrawStatusMsgBar(struct writeBuf *wBuf) {
-    clearLineRight(wBuf);
-    int msgLen = strlen(EC.status_msg);
-    if (msgLen > EC.screen_cols - 2) msgLen = EC.screen_cols - 2;
-    int timeLeft = time(NULL) - EC.status_msg_time;
-    bufAppend(wBuf, " ", 1);
-    if (msgLen && timeLeft < 5) bufAppend(wBuf, EC.status_msg, msgLen);
+// copy the chars of a warm row into fresh
+void editorMoveRowText(erow *row, struct rowArena *fresh) {
+    if (row->cold) return;
+    char *chars = arenaAlloc(fresh, row->size + 1, &row->cap);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
 }
 
-void editorAppendClrToBuf(struct writeBuf *wBuf, int code, int r, int g,
-                          int b) {
-    char buf[32];
-    int len = 0;
-    switch (code) {
-        case FOREGROUND:
-            len = snprintf(buf, sizeof(buf), "\x1b[%d;2;%d;%d;%dm", code, r, g,
-                           b);
-            break;
-        case BACKGROUND:
-            len = snprintf(buf, sizeof(buf), "\x1b[%d;2;%d;%d;%dm", code, r, g,
-                           b);
-            break;
-        default:
-            len = snprintf(buf, sizeof(buf), "\x1b[%dm", code);
-            break;
+// Move the warm rows into a fresh arena, so that the arena blocks the frozen
+// rows were released into go back to the system. The rows held by the undo
+// record live in the same arena and move along.
+void editorCompactText() {
+    struct rowArena fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    for (int i = 0; i < EC.data_rows; i++)
+        editorMoveRowText(&EC.row[i], &fresh);
+    for (int i = 0; EC.undo.rows && i < EC.undo.len; i++)
+        editorMoveRowText(&EC.undo.rows[i], &fresh);
+    arenaFreeAll(&EC.text);
+    EC.text = fresh;
+    editorDropRenderCaches();  // shared renders pointed into the old arena
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+// Freeze the warm rows more than two pages away from the view, a block at a
+// time, stopping early when a key is waiting. Called while idle.
+void editorFreezeRows() {
+    if (!coldRowsEnabled || EC.num_cursors || EC.load_fd != -1 ||
+        EC.warm_rows <= EC.warm_mark) {
+        return;
+    }
+    int hotFirst = EC.rowoff - 2 * EC.screen_rows;
+    int hotLast = EC.rowoff + 3 * EC.screen_rows;
+    int i = EC.freeze_next;
+    while (i < EC.data_rows) {
+        if (i >= hotFirst && i < hotLast) {
+            i = hotLast;
+            continue;
+        }
+        if (EC.row[i].cold) {
+            i++;
+            continue;
+        }
+        if (ttyInputPending()) {
+            EC.freeze_next = i;
+            return;
+        }
+        int first = i;
+        int bytes = 0;
+        while (i < EC.data_rows && EC.row[i].cold == NULL &&
+               (i < hotFirst || i >= hotLast) && bytes < TTE_COLD_BLOCK) {
+            bytes += EC.row[i].size + 1;
+            i++;
+        }
+        editorFreezeRun(first, i);
     }
-    bufAppend(wBuf, buf, len);
+    EC.freeze_next = 0;
+    EC.warm_mark = EC.warm_rows + TTE_COLD_SLACK;
+    if (EC.text.reserved >= 2 * EC.text.live + 2 * ARENA_BLOCK_SIZE)
+        editorCompactText();
+    logInfo("froze rows of %s: %d warm, %zuK compressed",
+            EC.filename ? EC.filename : "[NO Name]", EC.warm_rows,
+            EC.cold_bytes / 1024);
 }
 
-void editorDrawSidePanel(struct writeBuf *wBuf, const int lineNumber) {
-    char sideBuf[TTE_SIDE_PANEL_WIDTH + 1];
-    int len = snprintf(sideBuf, sizeof(sideBuf), "%4d ", lineNumber);
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** byte offsets ***/
 
-    editorAppendClrToBuf(wBuf, BACKGROUND, 31, 31, 40);
-    bufAppend(wBuf, sideBuf, len);
-    editorAppendClrToBuf(wBuf, D_BACKGROUND, 0, 0, 0);
+// EC.offsets groups the rows into blocks of about TTE_OFFSET_BLOCK and keeps
+// a Fenwick tree over the rows and one over the bytes (line endings
+// included) of each block. The byte offset of a row and the row at a byte
+// offset take O(log n) plus a scan of one block. Edits within a row and
+// inserting or deleting rows only change the counts of their block; a block
+// grown to twice the size is split, which rebuilds the trees from the block
+// counts. Reordering rows marks it stale and it is rebuilt in O(n) the next
+// time it is used. Rows appended at the end while loading are added then.
+
+// add delta to entry i (0-based) of a Fenwick tree over n entries
+void fenwickAdd(long long *tree, int n, int i, long long delta) {
+    for (i++; i <= n; i += i & -i) tree[i] += delta;
 }
 
-void editorDrawRows(struct writeBuf *wBuf) {
-    int screen_line_num;
-    int data_line_num = EC.rowoff;
-    for (screen_line_num = 0; screen_line_num < EC.screen_rows;
-         screen_line_num++) {
-        editorDrawSidePanel(wBuf, data_line_num + 1);
-        if (!EC.wrap_mode) {
-            clearLineRight(wBuf);
-            if (screen_line_num >= EC.data_rows) {
-                if (EC.data_rows == 0 &&
-                    screen_line_num == EC.screen_rows / 2) {
-                    printWelcomeMsg(wBuf);
-                } else {
-                    bufAppend(wBuf, "~", 1);
-                }
-            } else {
-                int len = EC.row[data_line_num].rsize - EC.coloff;
-                if (len < 0)
-                    len = 0;
-                else if (len > EC.screen_cols)
-                    len = EC.screen_cols;
-                bufAppend(wBuf, &EC.row[data_line_num].render[EC.coloff], len);
-            }
+// sum of the first i entries
+long long fenwickPrefix(const long long *tree, int i) {
+    long long sum = 0;
+    for (; i > 0; i -= i & -i) sum += tree[i];
+    return sum;
+}
 
-            bufAppend(wBuf, "\r\n", 2);
+// number of leading entries whose sum is at most *value, which is reduced
+// by that sum
+int fenwickFind(const long long *tree, int n, long long *value) {
+    int pos = 0;
+    int step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step; step /= 2) {
+        if (pos + step <= n && tree[pos + step] <= *value) {
+            pos += step;
+            *value -= tree[pos];
         }
-        //		else {
-        //      if (data_line_num > EC.data_rows) continue;
-        //      int size = EC.row[data_line_num].size;
-        //      int loopLen = ceil(size / EC.screen_cols);
-        //      for (int i = 0; i < loopLen; i++) {
-        //          clearLineRight(wBuf);
-
-        //          int startIndex = i * EC.screen_cols;
-        //          int len =
-        //              i != (loopLen - 1) ? EC.screen_cols : size -
-        //              startIndex;
+    }
+    return pos;
+}
 
-        //          bufAppend(wBuf,
-        //          &EC.row[data_line_num].chars[startIndex], len);
-        //          if (screen_line_num < EC.screen_rows - 1)
-        //              bufAppend(wBuf, "\r\n", 2);
-        //          else
-        //              break;
-        //          if (i != (loopLen - 1)) screen_line_num++;
-        //      }
-        //      data_line_num++;
-        //  }
-        data_line_num++;
+void fenwickBuild(long long *tree, const long long *values, int n) {
+    for (int i = 1; i <= n; i++) tree[i] = values[i - 1];
+    for (int i = 1; i <= n; i++) {
+        int parent = i + (i & -i);
+        if (parent <= n) tree[parent] += tree[i];
     }
 }
 
-void cursorToHome(struct writeBuf *wBuf) { bufAppend(wBuf, "\x1b[H", 3); }
+// bytes of rows [first, first + count) in the file
+long long editorRowsBytes(int first, int count) {
+    long long bytes = (long long)count * editorLineEndLength();
+    for (int i = first; i < first + count; i++) bytes += EC.row[i].size;
+    return bytes;
+}
 
-void cursorToPosition(struct writeBuf *wBuf) {
-    char buf[32];
+void byteIndexReserve(struct byteIndex *index, int blocks) {
+    if (index->cap >= blocks) return;
+    index->cap = blocks * 2;
+    index->rows = realloc(index->rows, sizeof(long long) * index->cap);
+    index->bytes = realloc(index->bytes, sizeof(long long) * index->cap);
+    index->row_tree =
+        realloc(index->row_tree, sizeof(long long) * (index->cap + 1));
+    index->byte_tree =
+        realloc(index->byte_tree, sizeof(long long) * (index->cap + 1));
+    if (!index->rows || !index->bytes || !index->row_tree || !index->byte_tree)
+        die("byteIndexReserve");
+}
 
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (EC.cy - EC.rowoff) + 1,
-             (EC.rx - EC.coloff) + 1 + TTE_SIDE_PANEL_WIDTH);
-    bufAppend(wBuf, buf, strlen(buf));
+void byteIndexFree(struct byteIndex *index) {
+    free(index->rows);
+    free(index->bytes);
+    free(index->row_tree);
+    free(index->byte_tree);
 }
 
-void cursorToStatusPos(int x) {
-    char buf[32];
+// block holding row, *first receives the row the block starts at. Rows past
+// the last one give the last block.
+int byteIndexBlock(struct byteIndex *index, int row, int *first) {
+    long long rest = row;
+    int block = fenwickFind(index->row_tree, index->blocks, &rest);
+    if (block == index->blocks) {
+        block--;
+        rest += index->rows[block];
+    }
+    *first = row - rest;
+    return block;
+}
 
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", EC.screen_cols, x);
-    write(STDOUT_FILENO, buf, strlen(buf));
+// Split block, which starts at row first and has grown past twice the
+// block size, into pieces of about the block size. Moving the blocks after
+// it and rebuilding the trees takes O(n / TTE_OFFSET_BLOCK).
+void byteIndexSplit(struct byteIndex *index, int block, int first) {
+    long long rows = index->rows[block];
+    int pieces = (rows + TTE_OFFSET_BLOCK - 1) / TTE_OFFSET_BLOCK;
+    byteIndexReserve(index, index->blocks + pieces - 1);
+    int tail = index->blocks - block - 1;
+    memmove(&index->rows[block + pieces], &index->rows[block + 1],
+            sizeof(long long) * tail);
+    memmove(&index->bytes[block + pieces], &index->bytes[block + 1],
+            sizeof(long long) * tail);
+    for (int i = 0; i < pieces; i++) {
+        long long count = rows * (i + 1) / pieces - rows * i / pieces;
+        index->rows[block + i] = count;
+        index->bytes[block + i] = editorRowsBytes(first, count);
+        first += count;
+    }
+    index->blocks += pieces - 1;
+    fenwickBuild(index->row_tree, index->rows, index->blocks);
+    fenwickBuild(index->byte_tree, index->bytes, index->blocks);
 }
 
-void editorClearScreen() { write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7); }
+// count rows were inserted at row at
+void byteIndexInsert(int at, int count) {
+    struct byteIndex *index = &EC.offsets;
+    if (!index->valid || at > index->n || count <= 0) return;
+    if (index->blocks == 0) {
+        index->valid = false;  // nothing to add them to, build it instead
+        return;
+    }
+    int first;
+    int block = byteIndexBlock(index, at, &first);
+    long long bytes = editorRowsBytes(at, count);
+    index->rows[block] += count;
+    index->bytes[block] += bytes;
+    index->n += count;
+    fenwickAdd(index->row_tree, index->blocks, block, count);
+    fenwickAdd(index->byte_tree, index->blocks, block, bytes);
+    if (index->rows[block] > 2 * TTE_OFFSET_BLOCK)
+        byteIndexSplit(index, block, first);
+}
 
-void hideCursor(struct writeBuf *wBuf) { bufAppend(wBuf, "\x1b[?25l", 6); }
+// count rows at row at are about to be deleted. Blocks left empty stay
+// until the next rebuild.
+void byteIndexDelete(int at, int count) {
+    struct byteIndex *index = &EC.offsets;
+    if (!index->valid || at >= index->n) return;
+    if (count > index->n - at) count = index->n - at;
+    int row = at;  // in EC.row, which still holds the rows
+    while (count > 0) {
+        int first;
+        int block = byteIndexBlock(index, at, &first);
+        int taken = index->rows[block] - (at - first);
+        if (taken > count) taken = count;
+        long long bytes = editorRowsBytes(row, taken);
+        index->rows[block] -= taken;
+        index->bytes[block] -= bytes;
+        index->n -= taken;
+        fenwickAdd(index->row_tree, index->blocks, block, -taken);
+        fenwickAdd(index->byte_tree, index->blocks, block, -bytes);
+        row += taken;
+        count -= taken;
+    }
+}
 
-void showCursor(struct writeBuf *wBuf) { bufAppend(wBuf, "\x1b[?25h", 6); }
+// the index, rebuilt if rows were reordered since it was used
+struct byteIndex *editorByteIndex() {
+    struct byteIndex *index = &EC.offsets;
+    if (index->valid && index->n < EC.data_rows)
+        byteIndexInsert(index->n, EC.data_rows - index->n);
+    if (index->valid && index->n == EC.data_rows) return index;
+    int n = EC.data_rows;
+    int blocks = (n + TTE_OFFSET_BLOCK - 1) / TTE_OFFSET_BLOCK;
+    byteIndexReserve(index, blocks > 0 ? blocks : 1);
+    index->blocks = blocks;
+    for (int b = 0; b < blocks; b++) {
+        int first = b * TTE_OFFSET_BLOCK;
+        int count = n - first < TTE_OFFSET_BLOCK ? n - first : TTE_OFFSET_BLOCK;
+        index->rows[b] = count;
+        index->bytes[b] = editorRowsBytes(first, count);
+    }
+    fenwickBuild(index->row_tree, index->rows, blocks);
+    fenwickBuild(index->byte_tree, index->bytes, blocks);
+    index->n = n;
+    index->valid = true;
+    return index;
+}
+
+// bytes in the rows before row
+long long byteIndexPrefix(struct byteIndex *index, int row) {
+    if (index->blocks == 0) return 0;
+    int first;
+    int block = byteIndexBlock(index, row, &first);
+    return fenwickPrefix(index->byte_tree, block) +
+           editorRowsBytes(first, row - first);
+}
+
+// row holding byte offset, *column receives the offset within it. Offsets
+// past the end give n.
+int byteIndexFind(struct byteIndex *index, long long offset,
+                  long long *column) {
+    int block = fenwickFind(index->byte_tree, index->blocks, &offset);
+    int row = fenwickPrefix(index->row_tree, block);
+    int end = block < index->blocks ? row + index->rows[block] : row;
+    int eol = editorLineEndLength();
+    while (row < end && EC.row[row].size + eol <= offset) {
+        offset -= EC.row[row].size + eol;
+        row++;
+    }
+    *column = offset;
+    return row;
+}
+
+// called after the size of row may have changed in place
+void byteIndexUpdate(int row) {
+    struct byteIndex *index = &EC.offsets;
+    if (!index->valid || row >= index->n) return;
+    int first;
+    int block = byteIndexBlock(index, row, &first);
+    long long delta =
+        editorRowsBytes(first, index->rows[block]) - index->bytes[block];
+    if (delta == 0) return;
+    index->bytes[block] += delta;
+    fenwickAdd(index->byte_tree, index->blocks, block, delta);
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** change tracking ***/
+
+// The buffer keeps the hash and file offset of every line as last read or
+// written (EC.saved). While rows only change in place, row i is compared
+// with saved line i on every edit and the count of differing rows decides
+// EC.dirty, so undoing an edit by hand makes the buffer clean again. Once
+// rows are inserted, deleted or reordered the buffer counts as dirty until
+// the rows are compared with the saved lines again while waiting for a key.
+
+void lineIndexReserve(struct lineIndex *index, int lines) {
+    if (index->offset && lines <= index->cap) return;
+    while (index->cap < lines) index->cap = index->cap ? index->cap * 2 : 4096;
+    index->hash = realloc(index->hash, sizeof(uint64_t) * index->cap);
+    index->offset = realloc(index->offset, sizeof(long long) * (index->cap + 1));
+}
+
+void lineIndexAdd(struct lineIndex *index, long long offset, uint64_t hash) {
+    lineIndexReserve(index, index->lines + 1);
+    index->offset[index->lines] = offset;
+    index->hash[index->lines++] = hash;
+}
+
+// mark size as the end of the last line
+void lineIndexEnd(struct lineIndex *index, long long size) {
+    lineIndexReserve(index, index->lines);
+    index->offset[index->lines] = size;
+}
+
+void lineIndexFree(struct lineIndex *index) {
+    free(index->hash);
+    free(index->offset);
+    memset(index, 0, sizeof(*index));
+}
+
+struct hashScanJob {
+    int row;               // first row to compare
+    const uint64_t *hash;  // line hash to compare it with
+    int step;              // 1 to scan forward, -1 backward
+    int lo;                // steps [lo, hi) handled by this job
+    int hi;
+    int match;             // first step that differs, or hi
+    int differ;            // steps that differ, when counting
+};
+
+void *hashScanWorker(void *arg) {
+    struct hashScanJob *job = arg;
+    job->match = job->hi;
+    for (int i = job->lo; i < job->hi; i++) {
+        if (EC.row[job->row + i * job->step].hash != job->hash[i * job->step]) {
+            job->match = i;
+            break;
+        }
+    }
+    return NULL;
+}
+
+void *hashCountWorker(void *arg) {
+    struct hashScanJob *job = arg;
+    job->differ = 0;
+    for (int i = job->lo; i < job->hi; i++) {
+        job->differ += EC.row[job->row + i].hash != job->hash[i];
+    }
+    return NULL;
+}
+
+// split count steps of a scan from row and hash over the workers
+int hashScanSplit(struct hashScanJob *jobs, int row, const uint64_t *hash,
+                  int step, int count) {
+    int workers = editorWorkerCount(count);
+    for (int i = 0; i < workers; i++) {
+        jobs[i] = (struct hashScanJob){
+            row, hash, step, (int)((long long)count * i / workers),
+            (int)((long long)count * (i + 1) / workers), 0, 0};
+    }
+    return workers;
+}
+
+// number of rows from row on, stepping by step, whose hashes equal the
+// line hashes from hash on, looking at no more than count of them
+int hashMatchLength(int row, const uint64_t *hash, int step, int count) {
+    struct hashScanJob jobs[TTE_MAX_WORKERS];
+    int workers = hashScanSplit(jobs, row, hash, step, count);
+    runParallel(hashScanWorker, jobs, sizeof(struct hashScanJob), workers);
+    int match = count;
+    for (int i = 0; i < workers; i++) {
+        if (jobs[i].match < jobs[i].hi && jobs[i].match < match)
+            match = jobs[i].match;
+    }
+    return match;
+}
+
+// Find where the rows differ from the lines in index: rows [*first, *last)
+// stand in for lines [*first, *lastLine), everything around them is equal.
+void editorChangedRange(const struct lineIndex *index, int *first, int *last,
+                        int *lastLine) {
+    int rows = EC.data_rows;
+    int lines = index->lines;
+    int common = rows < lines ? rows : lines;
+    int prefix = hashMatchLength(0, index->hash, 1, common);
+    int suffix = 0;
+    if (common > prefix) {
+        suffix = hashMatchLength(rows - 1, &index->hash[lines - 1], -1,
+                                 common - prefix);
+    }
+    *first = prefix;
+    *last = rows - suffix;
+    *lastLine = lines - suffix;
+}
+
+// called after row, which holds the hash before in the saved state, was
+// changed in place
+void editorRowEdited(erow *row, uint64_t before) {
+    byteIndexUpdate(row - EC.row);
+    if (EC.undo.kind) undoFree(&EC.undo);
+    if (EC.rows_moved) {
+        EC.dirty = true;
+        return;
+    }
+    uint64_t saved = EC.saved.hash[row - EC.row];
+    EC.rows_differ += (before == saved) - (row->hash == saved);
+    EC.dirty = EC.rows_differ > 0;
+}
+
+// called after rows were inserted, deleted or reordered
+void editorRowsMoved() {
+    if (EC.undo.kind) undoFree(&EC.undo);
+    EC.rows_moved = true;
+    EC.dirty = true;
+}
+
+// compare the rows with the saved lines again after they moved
+void editorCheckSaved() {
+    if (!EC.rows_moved || EC.data_rows != EC.saved.lines) return;
+    struct hashScanJob jobs[TTE_MAX_WORKERS];
+    int workers = hashScanSplit(jobs, 0, EC.saved.hash, 1, EC.data_rows);
+    runParallel(hashCountWorker, jobs, sizeof(struct hashScanJob), workers);
+    EC.rows_differ = 0;
+    for (int i = 0; i < workers; i++) EC.rows_differ += jobs[i].differ;
+    EC.rows_moved = false;
+    EC.dirty = EC.rows_differ > 0;
+}
+
+// Take the line ending of the file from its first line, which must still be
+// as read. Lines are written back with it.
+void editorDetectLineEnding() {
+    bool crlf = EC.data_rows && EC.saved.lines &&
+                EC.saved.offset[1] - EC.saved.offset[0] == EC.row[0].size + 2;
+    if (crlf != EC.crlf) EC.offsets.valid = false;  // every offset changes
+    EC.crlf = crlf;
+}
+
+// bytes after the text of each line in the file
+int editorLineEndLength() { return EC.crlf ? 2 : 1; }
+
+// Record the rows as saved after rows [first, last) were written from file
+// offset at on. Rows after last kept their bytes in the file, which happens
+// only when the rows written took exactly the bytes of the lines they
+// replaced.
+void editorMarkSaved(int first, int last, long long at) {
+    struct lineIndex next = {NULL, NULL, 0, 0};
+    lineIndexReserve(&next, EC.data_rows);
+    for (int i = 0; i < first; i++) {
+        lineIndexAdd(&next, EC.saved.offset[i], EC.saved.hash[i]);
+    }
+    long long pos = at;
+    for (int i = first; i < last; i++) {
+        lineIndexAdd(&next, pos, EC.row[i].hash);
+        pos += EC.row[i].size + editorLineEndLength();
+    }
+    int shift = EC.saved.lines - EC.data_rows;  // saved line of a later row
+    for (int i = last; i < EC.data_rows; i++) {
+        lineIndexAdd(&next, EC.saved.offset[i + shift],
+                     EC.saved.hash[i + shift]);
+    }
+    lineIndexEnd(&next,
+                 last < EC.data_rows ? EC.saved.offset[EC.saved.lines] : pos);
+    lineIndexFree(&EC.saved);
+    EC.saved = next;
+    EC.rows_differ = 0;
+    EC.rows_moved = false;
+    EC.dirty = false;
+}
+
+// work done while waiting for a key. Returns true if the screen changed.
+bool editorIdle() {
+    if (EC.load_fd != -1) {
+        editorCheckDisk();
+        while (EC.load_fd != -1 && !ttyInputPending()) {
+            editorLoadRows(EC.data_rows + TTE_LOAD_SLICE);
+        }
+        return true;
+    }
+    bool wasDirty = EC.dirty;
+    editorCheckSaved();
+    bool changed = editorCheckDisk() || EC.dirty != wasDirty;
+    editorFreezeRows();
+    return changed;
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** row operations ***/
+void expandBuffer() {
+    int newSize = (EC.rows_cap == 0) ? 1 : (EC.rows_cap * 2);
+    EC.row = realloc(EC.row, sizeof(erow) * newSize);
+    EC.rows_cap = newSize;
+}
+
+// make sure the row array can hold rows rows
+void reserveRows(int rows) {
+    while (EC.rows_cap < rows) expandBuffer();
+}
+
+// display column of byte offset cx in the row
+int editorRowCxtoRx(erow *row, int cx) {
+    if (!row->tabs && row->ascii) return cx;
+    int rx = 0;
+    int j = 0;
+    while (j < cx) {
+        int width = 1;
+        if (row->chars[j] == '\t') {
+            rx += (TTE_TAB_STOP - 1) - (rx % TTE_TAB_STOP);
+            j++;
+        } else {
+            j += utf8Next(&row->chars[j], row->size - j, &width);
+        }
+        rx += width;
+    }
+    return rx;
+}
+
+// byte offset of the character covering display column rx in the row
+int editorRowRxToCx(erow *row, int rx) {
+    if (!row->tabs && row->ascii) return rx < row->size ? rx : row->size;
+    int cur_rx = 0;
+    int cx = 0;
+    while (cx < row->size) {
+        int width = 1;
+        int len = 1;
+        if (row->chars[cx] == '\t')
+            cur_rx += (TTE_TAB_STOP - 1) - (cur_rx % TTE_TAB_STOP);
+        else
+            len = utf8Next(&row->chars[cx], row->size - cx, &width);
+        cur_rx += width;
+        if (cur_rx > rx) return cx;
+        cx += len;
+    }
+    return cx;
+}
+
+// start of the character before byte offset at in the row
+int editorRowPrevChar(erow *row, int at) {
+    if (at <= 0) return 0;
+    at--;
+    while (at > 0 && utf8IsContinuation(row->chars[at])) at--;
+    return at;
+}
+
+// start of the character after the one at byte offset at in the row
+int editorRowNextChar(erow *row, int at) {
+    if (at >= row->size) return row->size;
+    at++;
+    while (at < row->size && utf8IsContinuation(row->chars[at])) at++;
+    return at;
+}
+
+// 64 bit hash of a line, eight bytes per step
+uint64_t rowHash(const char *s, int len) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, &s[i], 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, &s[i], len - i);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 29);
+}
+
+// length of a line read from disk without its line ending
+int lineContentLength(const char *line, int len) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+    return len;
+}
+
+void editorUpdateRenderRow(erow *row) {
+    row->hash = rowHash(row->chars, row->size);
+    int tabs = 0;
+    char *tab = row->chars;
+    char *end = row->chars + row->size;
+    while ((tab = memchr(tab, '\t', end - tab)) != NULL) {
+        tabs++;
+        tab++;
+    }
+    row->tabs = tabs > 0;
+    row->ascii = utf8IsAscii(row->chars, row->size);
+
+    if (row->epoch != EC.render_epoch) {
+        // cache was dropped along with the memory it lived in
+        row->render = NULL;
+        row->rcap = 0;
+        row->epoch = EC.render_epoch;
+    }
+    if (tabs == 0) {
+        // render is identical to chars, share it. rcap 0 marks it shared.
+        arenaRelease(&EC.render, row->rcap ? row->render : NULL, row->rcap);
+        row->render = row->chars;
+        row->rcap = 0;
+        row->rsize = row->size;
+        return;
+    }
+
+    int need = row->size + tabs * (TTE_TAB_STOP - 1) + 1;
+    if (need > row->rcap) {
+        arenaRelease(&EC.render, row->rcap ? row->render : NULL, row->rcap);
+        row->render = arenaAlloc(&EC.render, need, &row->rcap);
+    }
+    // tab stops are in display columns, which differ from bytes in UTF-8
+    int idx = 0;
+    int col = 0;
+    for (int j = 0; j < row->size;) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            col++;
+            while (col % TTE_TAB_STOP != 0) {
+                row->render[idx++] = ' ';
+                col++;
+            }
+            j++;
+        } else {
+            int width;
+            int len = utf8Next(&row->chars[j], row->size - j, &width);
+            memcpy(&row->render[idx], &row->chars[j], len);
+            idx += len;
+            col += width;
+            j += len;
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+// render of row, rebuilt if its cache was dropped
+char *editorRowRender(erow *row) {
+    if (row->render == NULL || row->epoch != EC.render_epoch) {
+        editorUpdateRenderRow(row);
+    }
+    return row->render;
+}
+
+// forget every render cache of the current buffer and free their memory
+void editorDropRenderCaches() {
+    arenaFreeAll(&EC.render);
+    EC.render_epoch++;
+}
+
+// make room for need bytes in the chars of row
+void editorRowReserve(erow *row, int need) {
+    if (need <= row->cap) return;
+    row->chars = arenaGrow(&EC.text, row->chars, row->cap, need + need / 2,
+                           &row->cap);
+}
+
+// set up row as a new row holding a copy of len bytes of data
+void editorInitRow(erow *row, const char *data, size_t len) {
+    row->size = len;
+    row->chars = arenaAlloc(&EC.text, len + 1, &row->cap);
+    memcpy(row->chars, data, len);
+    row->chars[len] = '\0';
+
+    if (EC.max_data_cols < (int)len) {
+        EC.max_data_cols = len;
+    }
+
+    row->rsize = 0;
+    row->rcap = 0;
+    row->epoch = EC.render_epoch;
+    row->render = NULL;
+    row->cold = NULL;
+    EC.warm_rows++;
+    editorUpdateRenderRow(row);
+}
+
+// append a row read from the file, which is not a change to the buffer
+void editorAppendRow(const char *data, size_t len) {
+    if (EC.data_rows >= EC.rows_cap) {
+        expandBuffer();
+    }
+    editorInitRow(&EC.row[EC.data_rows++], data, len);
+}
+
+void editorInsertRow(char *data, size_t len, int insertAt) {
+    if (insertAt < 0 || insertAt > EC.data_rows) return;
+    if (EC.data_rows >= EC.rows_cap) {
+        expandBuffer();
+    }
+    memmove(&EC.row[insertAt + 1], &EC.row[insertAt],
+            sizeof(erow) * (EC.data_rows - insertAt));
+
+    editorInitRow(&EC.row[insertAt], data, len);
+    EC.data_rows++;
+    byteIndexInsert(insertAt, 1);
+    editorRowsMoved();
+}
+
+// replace count rows starting at at with the n rows set up in rows. The rows
+// after them are moved once, however many rows go in or out. The rows
+// replaced are moved to taken if it is not NULL, else freed.
+void editorReplaceRows(int at, int count, erow *rows, int n, erow *taken) {
+    if (at < 0 || count < 0 || at + count > EC.data_rows) return;
+    byteIndexDelete(at, count);
+    if (taken)
+        memcpy(taken, &EC.row[at], sizeof(erow) * count);
+    else
+        for (int i = at; i < at + count; i++) editorFreeRow(&EC.row[i]);
+    reserveRows(EC.data_rows - count + n);
+    memmove(&EC.row[at + n], &EC.row[at + count],
+            sizeof(erow) * (EC.data_rows - at - count));
+    if (n) memcpy(&EC.row[at], rows, sizeof(erow) * n);
+    EC.data_rows += n - count;
+    byteIndexInsert(at, n);
+    editorRowsMoved();
+}
+
+void editorRowInsertChar(erow *row, int insertAt, int c) {
+    if (insertAt < 0 || insertAt > row->size) insertAt = row->size;
+    uint64_t before = row->hash;
+    editorRowReserve(row, row->size + 2);
+    memmove(&row->chars[insertAt + 1], &row->chars[insertAt],
+            row->size - insertAt + 1);
+    row->size++;
+    row->chars[insertAt] = c;
+    editorUpdateRenderRow(row);
+    editorRowEdited(row, before);
+}
+
+// delete len bytes starting at delAt, or as many of them as the row has
+void editorRowDelRange(erow *row, int delAt, int len) {
+    if (delAt < 0 || delAt >= row->size || len <= 0) return;
+    if (len > row->size - delAt) len = row->size - delAt;
+    uint64_t before = row->hash;
+    memmove(&row->chars[delAt], &row->chars[delAt + len],
+            row->size - delAt - len + 1);
+    row->size -= len;
+    editorUpdateRenderRow(row);
+    editorRowEdited(row, before);
+}
+
+void editorRowDelChar(erow *row, int delAt) {
+    editorRowDelRange(row, delAt, 1);
+}
+
+void editorFreeRow(erow *row) {
+    if (row->cold) {
+        coldBlockRelease(row->cold);
+        row->cold = NULL;
+        return;
+    }
+    EC.warm_rows--;
+    if (row->rcap && row->epoch == EC.render_epoch) {
+        arenaRelease(&EC.render, row->render, row->rcap);
+    }
+    arenaRelease(&EC.text, row->chars, row->cap);
+    row->render = NULL;
+    row->chars = NULL;
+    row->rcap = 0;
+    row->cap = 0;
+}
+
+void editorDelRow(int rowIndex) {
+    if (rowIndex < 0 || rowIndex >= EC.data_rows) return;
+    byteIndexDelete(rowIndex, 1);
+    editorFreeRow(&EC.row[rowIndex]);
+    memmove(&EC.row[rowIndex], &EC.row[rowIndex + 1],
+            sizeof(erow) * (EC.data_rows - rowIndex - 1));
+    EC.data_rows--;
+    editorRowsMoved();
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    uint64_t before = row->hash;
+    editorRowReserve(row, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRenderRow(row);
+    editorRowEdited(row, before);
+}
+
+// replace the text of row with len bytes of s
+void editorRowSetString(erow *row, const char *s, size_t len) {
+    uint64_t before = row->hash;
+    editorRowReserve(row, len + 1);
+    memcpy(row->chars, s, len);
+    row->size = len;
+    row->chars[len] = '\0';
+    editorUpdateRenderRow(row);
+    editorRowEdited(row, before);
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** editor operations ***/
+void editorInsertChar(int c) {
+    // a new last row goes after the rows of the file not read in yet
+    if (EC.cy == EC.data_rows) editorLoadAll();
+    if (EC.cy == EC.data_rows) {
+        editorInsertRow("", 0, EC.data_rows);
+    }
+    editorRowInsertChar(&EC.row[EC.cy], EC.cx, c);
+    EC.cx++;
+}
+
+void editorDelChar() {
+    if (EC.cy == EC.data_rows) return;
+    if (EC.cx == 0 && EC.cy == 0) return;
+    erow *row = &EC.row[EC.cy];
+    if (EC.cx > 0) {
+        // remove the whole UTF-8 sequence before the cursor
+        int start = editorRowPrevChar(row, EC.cx);
+        editorRowDelRange(row, start, EC.cx - start);
+        EC.cx = start;
+    } else {
+        EC.cx = EC.row[EC.cy - 1].size;
+        editorRowAppendString(&EC.row[EC.cy - 1], row->chars, row->size);
+        editorDelRow(EC.cy);
+        EC.cy--;
+    }
+}
+
+void editorInsertNewline() {
+    if (EC.cy == EC.data_rows) editorLoadAll();
+    if (EC.cx == 0) {
+        editorInsertRow("", 0, EC.cy);
+    } else {
+        erow *row = &EC.row[EC.cy];
+        editorInsertRow(&row->chars[EC.cx], row->size - EC.cx, EC.cy + 1);
+        row = &EC.row[EC.cy];
+        uint64_t before = row->hash;
+        row->size = EC.cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRenderRow(row);
+        editorRowEdited(row, before);
+    }
+    EC.cy++;
+    EC.cx = 0;
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** undo ***/
+
+// Only the last batched edit can be undone: a keystroke applied to multiple
+// cursors, a filter, sort, uniq or grep. Rows it took out of the buffer are
+// kept rather than freed, a sort keeps its permutation and a multi-cursor
+// edit the text of the rows it changed. Any other change to the buffer goes
+// through editorRowEdited or editorRowsMoved, which drop the record.
+
+enum undoKind { UNDO_NONE, UNDO_TEXT, UNDO_REPLACE, UNDO_REMOVE, UNDO_ORDER };
+
+struct undoRecord undoBegin(int kind) {
+    struct undoRecord undo;
+    memset(&undo, 0, sizeof(undo));
+    if (kind == UNDO_TEXT && EC.undo.kind == UNDO_TEXT) {
+        // each key typed with many cursors replaces the record of the key
+        // before, so its buffers are reused rather than freed and faulted in
+        undo = EC.undo;
+        memset(&EC.undo, 0, sizeof(EC.undo));
+        undo.len = 0;
+        undo.count = 0;
+        undo.text_len = 0;
+    }
+    undo.kind = kind;
+    undo.cx = EC.cx;
+    undo.cy = EC.cy;
+    return undo;
+}
+
+void undoFree(struct undoRecord *undo) {
+    for (int i = 0; undo->rows && i < undo->len; i++)
+        editorFreeRow(&undo->rows[i]);
+    free(undo->rows);
+    free(undo->at);
+    free(undo->end);
+    free(undo->text);
+    memset(undo, 0, sizeof(*undo));
+}
+
+// make undo the record of the edit just made
+void undoKeep(struct undoRecord *undo) {
+    undoFree(&EC.undo);
+    EC.undo = *undo;
+}
+
+void undoReserve(struct undoRecord *undo) {
+    if (undo->len < undo->cap) return;
+    undo->cap = undo->cap ? undo->cap * 2 : 64;
+    undo->at = realloc(undo->at, sizeof(int) * undo->cap);
+    if (undo->kind == UNDO_TEXT)
+        undo->end = realloc(undo->end, sizeof(int) * undo->cap);
+    else
+        undo->rows = realloc(undo->rows, sizeof(erow) * undo->cap);
+}
+
+// keep row, taken out of the buffer at index at
+void undoAddRow(struct undoRecord *undo, erow *row, int at) {
+    undoReserve(undo);
+    undo->rows[undo->len] = *row;
+    undo->at[undo->len++] = at;
+}
+
+// keep a copy of the text of row at, about to be changed in place
+void undoSaveText(struct undoRecord *undo, int at) {
+    undoReserve(undo);
+    erow *row = &EC.row[at];
+    if (undo->text_len + row->size > undo->text_cap) {
+        undo->text_cap = (undo->text_len + row->size) * 2;
+        undo->text = realloc(undo->text, undo->text_cap);
+    }
+    memcpy(&undo->text[undo->text_len], row->chars, row->size);
+    undo->text_len += row->size;
+    undo->end[undo->len] = undo->text_len;
+    undo->at[undo->len++] = at;
+}
+
+// put the rows a uniq or grep took out back between the rows it kept
+void undoRestoreRows(struct undoRecord *undo) {
+    reserveRows(EC.data_rows + undo->len);
+    int end = undo->first + undo->count;
+    memmove(&EC.row[end + undo->len], &EC.row[end],
+            sizeof(erow) * (EC.data_rows - end));
+    int kept = end - 1;
+    int taken = undo->len - 1;
+    for (int i = end + undo->len - 1; i >= undo->first; i--) {
+        if (taken >= 0 && undo->at[taken] == i)
+            EC.row[i] = undo->rows[taken--];
+        else
+            EC.row[i] = EC.row[kept--];
+    }
+    EC.data_rows += undo->len;
+    undo->len = 0;  // the buffer owns them again
+}
+
+// put the rows a sort moved back in their order before it
+void undoRestoreOrder(struct undoRecord *undo) {
+    erow *sorted = malloc(sizeof(erow) * undo->count);
+    memcpy(sorted, &EC.row[undo->first], sizeof(erow) * undo->count);
+    for (int i = 0; i < undo->count; i++)
+        EC.row[undo->first + undo->at[i]] = sorted[i];
+    free(sorted);
+}
+
+void editorUndo() {
+    struct undoRecord undo = EC.undo;
+    memset(&EC.undo, 0, sizeof(EC.undo));
+    if (undo.kind == UNDO_NONE) {
+        editorSetStatusMsg("Nothing to undo");
+        return;
+    }
+    editorThawAll();
+    switch (undo.kind) {
+        case UNDO_TEXT:
+            for (int i = 0; i < undo.len; i++) {
+                int start = i ? undo.end[i - 1] : 0;
+                editorRowSetString(&EC.row[undo.at[i]],
+                                   undo.text ? &undo.text[start] : "",
+                                   undo.end[i] - start);
+            }
+            undo.len = 0;
+            if (undo.count)
+                editorReplaceRows(EC.data_rows - undo.count, undo.count, NULL,
+                                  0, NULL);
+            break;
+        case UNDO_REPLACE:
+            editorReplaceRows(undo.first, undo.count, undo.rows, undo.len,
+                              NULL);
+            undo.len = 0;
+            break;
+        case UNDO_REMOVE:
+        case UNDO_ORDER:
+            if (undo.kind == UNDO_REMOVE)
+                undoRestoreRows(&undo);
+            else
+                undoRestoreOrder(&undo);
+            EC.offsets.valid = false;
+            editorRowsMoved();
+            break;
+    }
+    EC.cx = undo.cx;
+    EC.cy = undo.cy;
+    undoFree(&undo);
+    editorClearCursors();
+    editorClampCursor();
+    editorSetStatusMsg("Undone");
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** multiple cursors ***/
+
+// Edits with extra cursors are applied to all cursors at once. Cursors are
+// grouped by row and every affected row is rewritten in a single pass, with
+// its render rebuilt once, no matter how many cursors it holds.
+
+int cursorCompare(const struct cursorPos *a, const struct cursorPos *b) {
+    if (a->cy != b->cy) return a->cy < b->cy ? -1 : 1;
+    return (a->cx > b->cx) - (a->cx < b->cx);
+}
+
+// all cursors, the primary one included, in order. *primary receives the
+// index of the primary cursor. The caller frees the array.
+struct cursorPos *editorAllCursors(int *count, int *primary) {
+    struct cursorPos self = {EC.cy, EC.cx};
+    int lo = 0;
+    int hi = EC.num_cursors;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cursorCompare(&EC.cursors[mid], &self) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    struct cursorPos *all =
+        malloc(sizeof(struct cursorPos) * (EC.num_cursors + 1));
+    memcpy(all, EC.cursors, sizeof(struct cursorPos) * lo);
+    all[lo] = self;
+    memcpy(&all[lo + 1], &EC.cursors[lo],
+           sizeof(struct cursorPos) * (EC.num_cursors - lo));
+    *count = EC.num_cursors + 1;
+    *primary = lo;
+    return all;
+}
+
+// store the sorted cursors back, merging cursors that ended up in the same
+// place. The primary one wins a merge.
+void editorSetCursors(struct cursorPos *all, int count, int primary) {
+    EC.cy = all[primary].cy;
+    EC.cx = all[primary].cx;
+    EC.num_cursors = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == primary || (all[i].cy == EC.cy && all[i].cx == EC.cx))
+            continue;
+        if (EC.num_cursors &&
+            cursorCompare(&EC.cursors[EC.num_cursors - 1], &all[i]) == 0)
+            continue;
+        if (EC.num_cursors == EC.cursors_cap) {
+            EC.cursors_cap = EC.cursors_cap ? EC.cursors_cap * 2 : 16;
+            EC.cursors = realloc(EC.cursors,
+                                 sizeof(struct cursorPos) * EC.cursors_cap);
+        }
+        EC.cursors[EC.num_cursors++] = all[i];
+    }
+}
+
+void editorClearCursors() { EC.num_cursors = 0; }
+
+// insert c at each of the n ascending offsets in pos, moving the tail of the
+// row once from the end backwards. pos is updated to just after each insert.
+void editorRowInsertCharMulti(erow *row, int *pos, int n, int c) {
+    uint64_t before = row->hash;
+    editorRowReserve(row, row->size + n + 1);
+    int end = row->size + 1;  // including the terminating '\0'
+    for (int i = n - 1; i >= 0; i--) {
+        memmove(&row->chars[pos[i] + i + 1], &row->chars[pos[i]],
+                end - pos[i]);
+        row->chars[pos[i] + i] = c;
+        end = pos[i];
+    }
+    row->size += n;
+    for (int i = 0; i < n; i++) pos[i] += i + 1;
+    editorUpdateRenderRow(row);
+    editorRowEdited(row, before);
+}
+
+// delete the character before (direction -1) or after (direction 1) each of
+// the n ascending offsets in pos in one compacting pass over the row.
+void editorRowDelCharMulti(erow *row, int *pos, int n, int direction) {
+    int write = 0;
+    int read = 0;
+    bool changed = false;
+    for (int i = 0; i < n; i++) {
+        int start = pos[i];
+        int end = pos[i];
+        if (direction < 0 && pos[i] > 0) start = editorRowPrevChar(row, pos[i]);
+        if (direction > 0) end = editorRowNextChar(row, pos[i]);
+        if (write != read) {
+            memmove(&row->chars[write], &row->chars[read], start - read);
+        }
+        write += start - read;
+        pos[i] = write;
+        read = end;
+        if (end > start) changed = true;
+    }
+    if (!changed) return;
+    uint64_t before = row->hash;
+    memmove(&row->chars[write], &row->chars[read], row->size - read + 1);
+    row->size = write + row->size - read;
+    editorUpdateRenderRow(row);
+    editorRowEdited(row, before);
+}
+
+enum multiEdit { MULTI_INSERT, MULTI_BACKSPACE, MULTI_DELETE };
+
+// apply one edit to every cursor as a single batched mutation
+void editorMultiEdit(int edit, int c) {
+    int count;
+    int primary;
+    struct cursorPos *all = editorAllCursors(&count, &primary);
+    int *pos = malloc(sizeof(int) * count);
+    struct undoRecord undo = undoBegin(UNDO_TEXT);
+
+    if (edit == MULTI_INSERT && all[count - 1].cy == EC.data_rows) {
+        editorInsertRow("", 0, EC.data_rows);
+        undo.count = 1;
+    }
+    for (int first = 0; first < count;) {
+        int cy = all[first].cy;
+        int n = 0;
+        while (first + n < count && all[first + n].cy == cy) {
+            pos[n] = all[first + n].cx;
+            n++;
+        }
+        if (cy < EC.data_rows) {
+            undoSaveText(&undo, cy);
+            erow *row = &EC.row[cy];
+            if (edit == MULTI_INSERT)
+                editorRowInsertCharMulti(row, pos, n, c);
+            else
+                editorRowDelCharMulti(row, pos, n,
+                                      edit == MULTI_BACKSPACE ? -1 : 1);
+            for (int i = 0; i < n; i++) all[first + i].cx = pos[i];
+        }
+        first += n;
+    }
+    undoKeep(&undo);
+
+    editorSetCursors(all, count, primary);
+    free(pos);
+    free(all);
+}
+
+// move every cursor within its own row
+void editorMultiMove(int key) {
+    int count;
+    int primary;
+    struct cursorPos *all = editorAllCursors(&count, &primary);
+    for (int i = 0; i < count; i++) {
+        if (all[i].cy >= EC.data_rows) continue;
+        erow *row = &EC.row[all[i].cy];
+        switch (key) {
+            case ARROW_LEFT:
+                all[i].cx = editorRowPrevChar(row, all[i].cx);
+                break;
+            case ARROW_RIGHT:
+                all[i].cx = editorRowNextChar(row, all[i].cx);
+                break;
+            case HOME:
+                all[i].cx = 0;
+                break;
+            case END:
+                all[i].cx = row->size;
+                break;
+        }
+    }
+    editorSetCursors(all, count, primary);
+    free(all);
+}
+
+// add a cursor at the primary cursor's column on row cy
+void editorAddCursorAt(int cy, int rx) {
+    if (EC.num_cursors == EC.cursors_cap) {
+        EC.cursors_cap = EC.cursors_cap ? EC.cursors_cap * 2 : 16;
+        EC.cursors =
+            realloc(EC.cursors, sizeof(struct cursorPos) * EC.cursors_cap);
+    }
+    EC.cursors[EC.num_cursors].cy = cy;
+    EC.cursors[EC.num_cursors].cx = editorRowRxToCx(&EC.row[cy], rx);
+    EC.num_cursors++;
+}
+
+// add a cursor on the row below the lowest cursor
+void editorAddCursorBelow() {
+    if (EC.cy >= EC.data_rows) return;
+    editorThawAll();
+    int last = EC.cy;
+    if (EC.num_cursors && EC.cursors[EC.num_cursors - 1].cy > last)
+        last = EC.cursors[EC.num_cursors - 1].cy;
+    if (last + 1 >= EC.data_rows) return;
+    editorAddCursorAt(last + 1, editorRowCxtoRx(&EC.row[EC.cy], EC.cx));
+    editorSetStatusMsg("%d cursors", EC.num_cursors + 1);
+}
+
+// put a cursor at the primary cursor's column on every row, for column edits
+void editorAddCursorsAllRows() {
+    editorLoadAll();
+    editorThawAll();
+    if (EC.cy >= EC.data_rows) return;
+    int rx = editorRowCxtoRx(&EC.row[EC.cy], EC.cx);
+    EC.num_cursors = 0;
+    for (int cy = 0; cy < EC.data_rows; cy++) {
+        if (cy != EC.cy) editorAddCursorAt(cy, rx);
+    }
+    editorSetStatusMsg("%d cursors", EC.num_cursors + 1);
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** line cache ***/
+
+// The line index of a large file is kept in a cache directory so opening
+// it again needs no scan of the file: the first screen is read straight
+// from the cached offsets and the remaining rows are read while the editor
+// waits for keys, or as soon as something needs the whole buffer. A cache
+// is only used when the size, mtime, inode and a hash of the start and end
+// of the file still match, and its contents carry a checksum; otherwise the
+// file is read as usual and the cache is written again in the background.
+
+// hash of the first and last TTE_CACHE_SAMPLE bytes of the file open on fd
+uint64_t lineCacheSample(int fd, off_t size) {
+    char *buf = malloc(TTE_CACHE_SAMPLE);
+    uint64_t sample = 0;
+    off_t at[2] = {0, size > TTE_CACHE_SAMPLE ? size - TTE_CACHE_SAMPLE : 0};
+    for (int i = 0; i < 2; i++) {
+        ssize_t n = pread(fd, buf, TTE_CACHE_SAMPLE, at[i]);
+        sample = sample * 31 + rowHash(buf, n > 0 ? n : 0);
+    }
+    free(buf);
+    return sample;
+}
+
+uint64_t lineCacheChecksum(const struct lineIndex *index) {
+    uint64_t sum = rowHash((const char *)index->offset,
+                           sizeof(long long) * (index->lines + 1));
+    return sum * 31 + rowHash((const char *)index->hash,
+                              sizeof(uint64_t) * index->lines);
+}
+
+// path of the cache file for filename, or NULL if there is no cache
+// directory. The directory is created when create is set.
+char *lineCachePath(const char *filename, bool create) {
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg)
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return NULL;
+    if (create) mkdir(dir, 0700);
+    strncat(dir, "/tte", sizeof(dir) - strlen(dir) - 1);
+    if (create) mkdir(dir, 0700);
+
+    char *real = realpath(filename, NULL);
+    if (real == NULL) return NULL;
+    char *path = malloc(PATH_MAX + 32);
+    snprintf(path, PATH_MAX + 32, "%s/%016llx.idx", dir,
+             (unsigned long long)rowHash(real, strlen(real)));
+    free(real);
+    return path;
+}
+
+// Read the cached index of the file open on fd into index. Returns false
+// when there is none or it does not match the file.
+bool lineCacheLoad(const char *filename, int fd, const struct stat *st,
+                   struct lineIndex *index, int *maxCols) {
+    char *path = lineCachePath(filename, false);
+    if (path == NULL) return false;
+    FILE *fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) return false;
+
+    struct lineCacheHeader header;
+    struct fileStamp stamp = fileStampOf(st);
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+              memcmp(header.magic, TTE_CACHE_MAGIC, sizeof(header.magic)) ==
+                  0 &&
+              header.dev == (uint64_t)stamp.dev &&
+              header.ino == (uint64_t)stamp.ino &&
+              header.size == (int64_t)stamp.size &&
+              header.mtime_sec == (int64_t)stamp.mtime_sec &&
+              header.mtime_nsec == (int64_t)stamp.mtime_nsec &&
+              header.lines >= 0 && header.lines <= header.size + 1 &&
+              header.sample == lineCacheSample(fd, st->st_size);
+    if (ok) {
+        memset(index, 0, sizeof(*index));
+        lineIndexReserve(index, header.lines);
+        index->lines = header.lines;
+        ok = fread(index->offset, sizeof(long long), index->lines + 1, fp) ==
+                 (size_t)index->lines + 1 &&
+             fread(index->hash, sizeof(uint64_t), index->lines, fp) ==
+                 (size_t)index->lines &&
+             index->offset[index->lines] == header.size &&
+             lineCacheChecksum(index) == header.checksum;
+        if (!ok) lineIndexFree(index);
+        *maxCols = header.max_cols;
+    }
+    fclose(fp);
+    if (!ok) logInfo("line cache of %s is stale, rebuilding it", filename);
+    return ok;
+}
+
+struct lineCacheJob {
+    char *path;
+    struct lineCacheHeader header;
+    struct lineIndex index;
+};
+
+// writer threads not joined yet, so quitting can wait for their files
+struct lineCacheWriters {
+    pthread_t *thread;
+    int len;
+    int cap;
+} cacheWriters;
+
+// write a cache file next to its final place and move it there, so a
+// reader never sees a partly written one
+void *lineCacheWriter(void *arg) {
+    struct lineCacheJob *job = arg;
+    char tmp[PATH_MAX + 40];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", job->path, (int)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if (fp) {
+        bool ok = fwrite(&job->header, sizeof(job->header), 1, fp) == 1 &&
+                  fwrite(job->index.offset, sizeof(long long),
+                         job->index.lines + 1,
+                         fp) == (size_t)job->index.lines + 1 &&
+                  fwrite(job->index.hash, sizeof(uint64_t), job->index.lines,
+                         fp) == (size_t)job->index.lines;
+        ok = fclose(fp) == 0 && ok;
+        if (!ok || rename(tmp, job->path) == -1) unlink(tmp);
+    }
+    free(job->path);
+    lineIndexFree(&job->index);
+    free(job);
+    return NULL;
+}
+
+// save the index of the file just read from fd to the cache in the
+// background
+void editorCacheLines(int fd) {
+    struct stat st;
+    if (!lineCacheEnabled || fstat(fd, &st) == -1 ||
+        st.st_size < TTE_CACHE_MIN_BYTES) {
+        return;
+    }
+    char *path = lineCachePath(EC.filename, true);
+    if (path == NULL) return;
+    struct lineCacheJob *job = calloc(1, sizeof(struct lineCacheJob));
+    job->path = path;
+    struct fileStamp stamp = fileStampOf(&st);
+    memcpy(job->header.magic, TTE_CACHE_MAGIC, sizeof(job->header.magic));
+    job->header.dev = stamp.dev;
+    job->header.ino = stamp.ino;
+    job->header.size = stamp.size;
+    job->header.mtime_sec = stamp.mtime_sec;
+    job->header.mtime_nsec = stamp.mtime_nsec;
+    job->header.sample = lineCacheSample(fd, st.st_size);
+    job->header.lines = EC.saved.lines;
+    job->header.max_cols = EC.max_data_cols;
+    lineIndexReserve(&job->index, EC.saved.lines);
+    job->index.lines = EC.saved.lines;
+    memcpy(job->index.hash, EC.saved.hash, sizeof(uint64_t) * EC.saved.lines);
+    memcpy(job->index.offset, EC.saved.offset,
+           sizeof(long long) * (EC.saved.lines + 1));
+    job->header.checksum = lineCacheChecksum(&job->index);
+
+    int running = 0;  // forget the writers that are done
+    for (int i = 0; i < cacheWriters.len; i++) {
+        if (pthread_tryjoin_np(cacheWriters.thread[i], NULL) != 0)
+            cacheWriters.thread[running++] = cacheWriters.thread[i];
+    }
+    cacheWriters.len = running;
+    if (cacheWriters.len == cacheWriters.cap) {
+        cacheWriters.cap = cacheWriters.cap ? cacheWriters.cap * 2 : 4;
+        cacheWriters.thread = realloc(cacheWriters.thread,
+                                      sizeof(pthread_t) * cacheWriters.cap);
+        if (cacheWriters.thread == NULL) die("editorCacheLines");
+    }
+    pthread_t *thread = &cacheWriters.thread[cacheWriters.len];
+    if (pthread_create(thread, NULL, lineCacheWriter, job) == 0) {
+        cacheWriters.len++;
+    } else {
+        lineCacheWriter(job);
+    }
+}
+
+// wait for the cache files still being written, which would otherwise be
+// left behind as temporary files by exiting
+void lineCacheJoinWriters() {
+    for (int i = 0; i < cacheWriters.len; i++)
+        pthread_join(cacheWriters.thread[i], NULL);
+    cacheWriters.len = 0;
+}
+
+// The file of a lazy open was written to before all of it was read, so the
+// cached offsets of the rest are wrong. The buffer is cut to the lines read
+// so far and the cache dropped; editorCheckDisk then reloads the file, or
+// warns if the buffer was edited.
+void editorLoadStale() {
+    close(EC.load_fd);
+    EC.load_fd = -1;
+    EC.saved.lines = EC.load_next;
+    EC.disk_changed = true;
+    EC.disk_check = true;
+    char *path = lineCachePath(EC.filename, false);
+    if (path) unlink(path);
+    free(path);
+    editorSetStatusMsg("%s changed on disk while it was read, %d lines read",
+                       fileBaseName(EC.filename), EC.load_next);
+    logWarn("%s changed while loading, stopped at line %d", EC.filename,
+            EC.load_next);
+}
+
+// Materialize saved lines of a lazily opened file until the buffer has at
+// least rows rows or the whole file is in.
+void editorLoadRows(int rows) {
+    while (EC.load_fd != -1 && EC.data_rows < rows) {
+        struct stat st;
+        if (fstat(EC.load_fd, &st) == -1 ||
+            !fileStampEqual(fileStampOf(&st), EC.disk)) {
+            editorLoadStale();
+            return;
+        }
+        int first = EC.load_next;
+        int want = rows - EC.data_rows;
+        int last = want > EC.saved.lines - first ? EC.saved.lines
+                                                 : first + want;
+        if (last - first > TTE_LOAD_SLICE) last = first + TTE_LOAD_SLICE;
+
+        long long from = EC.saved.offset[first];
+        size_t size = EC.saved.offset[last] - from;
+        char *text = malloc(size ? size : 1);
+        size_t got = 0;
+        ssize_t n = 1;
+        while (got < size && (n = pread(EC.load_fd, text + got, size - got,
+                                        from + got)) > 0) {
+            got += n;
+        }
+        if (got < size) {
+            editorSetStatusMsg("Reading %s failed: %s", EC.filename,
+                               n == 0 ? "file is shorter" : strerror(errno));
+            logError("loading %s stopped at line %d", EC.filename, first);
+            last = first;
+        }
+        for (int i = first; i < last; i++) {
+            char *line = text + (EC.saved.offset[i] - from);
+            int len = EC.saved.offset[i + 1] - EC.saved.offset[i];
+            editorAppendRow(line, lineContentLength(line, len));
+        }
+        free(text);
+        EC.load_next = last;
+        if (last == first || last == EC.saved.lines) {
+            close(EC.load_fd);
+            EC.load_fd = -1;
+            logInfo("loaded %s: %d rows", EC.filename, EC.data_rows);
+        }
+    }
+}
+
+// materialize every row before something that needs the whole buffer
+void editorLoadAll() {
+    if (EC.load_fd != -1) editorLoadRows(INT_MAX);
+}
+
+// Open the file on fd from its cached line index, reading only the first
+// screen now. Returns false when there is no usable cache.
+bool editorOpenCached(int fd) {
+    struct stat st;
+    if (!lineCacheEnabled || fstat(fd, &st) == -1 ||
+        st.st_size < TTE_CACHE_MIN_BYTES) {
+        return false;
+    }
+    struct lineIndex index;
+    int maxCols;
+    if (!lineCacheLoad(EC.filename, fd, &st, &index, &maxCols)) return false;
+
+    lineIndexFree(&EC.saved);
+    EC.saved = index;
+    if (EC.max_data_cols < maxCols) EC.max_data_cols = maxCols;
+    reserveRows(index.lines);
+    EC.load_fd = fd;
+    EC.load_next = 0;
+    editorStampFile(fd);
+    editorLoadRows(EC.screen_rows > 0 ? EC.screen_rows : 1);
+    editorDetectLineEnding();
+    EC.rows_differ = 0;
+    EC.rows_moved = false;
+    EC.dirty = false;
+    logInfo("opened %s from its line cache: %d lines", EC.filename,
+            index.lines);
+    return true;
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** file i/o ***/
+
+bool fileExists(char *filename) {
+    if (filename == NULL) return false;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 && errno == ENOENT) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+// Split the file open on fd into lines and pass each to line, without its
+// '\n', along with the offset it starts at. The file is read in large chunks
+// and split in place; only a line straddling two chunks is copied, into
+// carry. Returns the number of bytes read, or -1 on a read error.
+long long readLines(int fd, void (*line)(void *, long long, char *, int),
+                    void *ctx) {
+    char *chunk = malloc(TTE_READ_CHUNK);
+    struct writeBuf carry = WRITEBUF_INIT;
+    long long pos = 0;        // offset of chunk in the file
+    long long lineStart = 0;  // offset of the line being split
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, chunk, TTE_READ_CHUNK)) > 0) {
+        char *start = chunk;
+        char *end = chunk + bytes_read;
+        char *newline;
+        while ((newline = memchr(start, '\n', end - start)) != NULL) {
+            if (carry.len) {
+                bufAppend(&carry, start, newline - start);
+                line(ctx, lineStart, carry.pointer, carry.len);
+                carry.len = 0;
+            } else {
+                line(ctx, lineStart, start, newline - start);
+            }
+            start = newline + 1;
+            lineStart = pos + (start - chunk);
+        }
+        bufAppend(&carry, start, end - start);
+        pos += bytes_read;
+    }
+    if (bytes_read != -1 && carry.len) {
+        line(ctx, lineStart, carry.pointer, carry.len);
+    }
+    bufFree(&carry);
+    free(chunk);
+    return bytes_read == -1 ? -1 : pos;
+}
+
+// append a line read from disk, without its line ending
+void editorOpenLine(void *ctx, long long offset, char *line, int linelen) {
+    (void)ctx;
+    editorAppendRow(line, lineContentLength(line, linelen));
+    lineIndexAdd(&EC.saved, offset, EC.row[EC.data_rows - 1].hash);
+}
+
+void editorOpen(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+
+    free(EC.filename);
+    EC.filename = strdup(filename);
+    if (editorOpenCached(fd)) return;
+
+    long long size = readLines(fd, editorOpenLine, NULL);
+    if (size == -1) die("read");
+    lineIndexEnd(&EC.saved, size);
+    editorDetectLineEnding();
+    editorStampFile(fd);
+    editorCacheLines(fd);
+    close(fd);
+    EC.rows_differ = 0;
+    EC.rows_moved = false;
+    EC.dirty = false;
+    logInfo("opened %s: %d rows", filename, EC.data_rows);
+}
+
+// rows [first, last) joined into one string, each ending in the line
+// ending of the file
+char *editorRowsToString(int first, int last, int *buflen) {
+    int eol = editorLineEndLength();
+    int totalLen = 0;
+    for (int rowIndex = first; rowIndex < last; rowIndex++)
+        totalLen += EC.row[rowIndex].size + eol;
+
+    *buflen = totalLen;
+
+    char *outBuf = malloc(totalLen + 1);
+    char *rowPtr = outBuf;
+
+    for (int rowIndex = first; rowIndex < last; rowIndex++) {
+        memcpy(rowPtr, editorRowChars(&EC.row[rowIndex]),
+               EC.row[rowIndex].size);
+        rowPtr += EC.row[rowIndex].size;
+        if (eol == 2) *rowPtr++ = '\r';
+        *rowPtr++ = '\n';
+    }
+    rowPtr = NULL;
+    return outBuf;
+}
+
+// Write the buffer to the file open on fd. If the file is still the one the
+// buffer was read from or saved to, the rows before the first changed one
+// are left alone, and when the changed rows take exactly the bytes of the
+// lines they replace, so is everything after them. Returns the number of
+// bytes written, or -1.
+int editorWriteRows(int fd) {
+    int first = 0;
+    int last = EC.data_rows;
+    long long at = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && fileStampEqual(fileStampOf(&st), EC.disk) &&
+        EC.saved.offset) {
+        int lastLine;
+        editorChangedRange(&EC.saved, &first, &last, &lastLine);
+        at = EC.saved.offset[first];
+        long long bytes = 0;
+        for (int i = first; i < last; i++)
+            bytes += EC.row[i].size + editorLineEndLength();
+        if (bytes != EC.saved.offset[lastLine] - at) last = EC.data_rows;
+    }
+
+    int len;
+    char *buf = editorRowsToString(first, last, &len);
+    int written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(fd, buf + written, len - written, at + written);
+        if (n <= 0) break;
+        written += n;
+    }
+    free(buf);
+    if (written < len) return -1;
+    if (last == EC.data_rows && ftruncate(fd, at + len) == -1) return -1;
+    editorMarkSaved(first, last, at);
+    return len;
+}
+
+void editorSave() {
+    editorLoadAll();
+    bool named = false;  // the name was typed in just now
+    if (EC.filename == NULL) {
+        named = true;
+        EC.filename = editorPrompt("save as:%s", NULL);
+        if (EC.filename == NULL) {
+            editorSetStatusMsg("save aborted");
+            return;
+        }
+    }
+
+    if (fileExists(EC.filename)) {
+        char *response;
+        response = editorPrompt(
+            EC.disk_changed
+                ? "File changed on disk since it was read! overwrite? "
+                  "Enter [Y]es or [N]o?%s"
+                : "File already exists. overwrite? Enter [Y]es or [N]o?%s",
+            NULL);
+        bool yes = response && (response[0] == 'y' || response[0] == 'Y');
+        free(response);
+        if (!yes) {
+            editorSetStatusMsg("save aborted");
+            if (named) {
+                free(EC.filename);
+                EC.filename = NULL;
+            }
+            return;
+        }
+    }
+
+    int fd = open(EC.filename, O_RDWR | O_CREAT, 0644);
+    int len = fd == -1 ? -1 : editorWriteRows(fd);
+    if (len != -1) {
+        editorStampFile(fd);
+        close(fd);
+        if (len == 0 && EC.data_rows) {
+            editorSetStatusMsg("No changes to write. File is saved!");
+        } else {
+            editorSetStatusMsg("%d bytes written to disk. File is saved!",
+                               len);
+        }
+        logInfo("saved %s: %d bytes", EC.filename, len);
+        return;
+    }
+    if (fd != -1) close(fd);
+    editorSetStatusMsg("Saving Failed! ERROR: %s", strerror(errno));
+    logError("saving %s failed: %s", EC.filename, strerror(errno));
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+/*** buffers ***/
+
+// free everything the current buffer owns and leave it empty
+void editorFreeBuffer() {
+    undoFree(&EC.undo);  // its rows live in the arenas freed below
+    if (EC.reload) editorFreeReload(editorTakeReload());
+    if (EC.load_fd != -1) close(EC.load_fd);
+    arenaFreeAll(&EC.text);
+    arenaFreeAll(&EC.render);
+    editorFreeColdBlocks();
+    free(EC.row);
+    free(EC.filename);
+    free(EC.cursors);
+    lineIndexFree(&EC.saved);
+    byteIndexFree(&EC.offsets);
+    editorUnwatchFile();
+    editorInitBuffer();
+}
+
+// make next the current buffer, keeping the editor wide state of EC
+void editorActivateBuffer(struct editorConfig *next) {
+    next->screen_rows = EC.screen_rows;
+    next->screen_cols = EC.screen_cols;
+    next->wrap_mode = EC.wrap_mode;
+    memcpy(next->status_msg, EC.status_msg, sizeof(EC.status_msg));
+    next->status_msg_time = EC.status_msg_time;
+    next->org_termios = EC.org_termios;
+    EC = *next;
+}
+
+// park the current buffer in its slot. Its render caches are dropped, they
+// are rebuilt for the visible rows only once it is shown again.
+void editorStashBuffer() {
+    if (EB.len + 1 > EB.cap) {  // room for a buffer about to be added
+        EB.cap = EB.cap ? EB.cap * 2 : 4;
+        EB.slot = realloc(EB.slot, sizeof(struct editorConfig) * EB.cap);
+    }
+    editorDropRenderCaches();
+    EB.slot[EB.current] = EC;
+}
+
+void editorSwitchBuffer(int index) {
+    if (index < 0 || index >= EB.len || index == EB.current) return;
+    editorStashBuffer();
+    struct editorConfig next = EB.slot[index];
+    EB.current = index;
+    editorActivateBuffer(&next);
+    editorSetStatusMsg("buffer %d/%d: %s", EB.current + 1, EB.len,
+                       EC.filename ? EC.filename : "[NO Name]");
+}
+
+// add an empty buffer after the others and make it current
+void editorNewBuffer() {
+    editorStashBuffer();
+    EB.current = EB.len++;
+    editorInitBuffer();
+}
+
+void editorCloseBuffer() {
+    editorFreeBuffer();
+    if (EB.len == 1) return;  // there is always one buffer, now empty
+    memmove(&EB.slot[EB.current], &EB.slot[EB.current + 1],
+            sizeof(struct editorConfig) * (EB.len - EB.current - 1));
+    EB.len--;
+    if (EB.current == EB.len) EB.current--;
+    struct editorConfig next = EB.slot[EB.current];
+    editorActivateBuffer(&next);
+}
+
+bool editorAnyDirty() {
+    if (EC.dirty) return true;
+    for (int i = 0; i < EB.len; i++) {
+        if (i != EB.current && EB.slot[i].dirty) return true;
+    }
+    return false;
+}
+
+void editorOpenBuffer() {
+    char *name = editorPrompt("open: %s (ESC to cancel)", NULL);
+    if (name == NULL) return;
+    if (fileExists(name) && access(name, R_OK) != 0) {
+        editorSetStatusMsg("Cannot open %s: %s", name, strerror(errno));
+        free(name);
+        return;
+    }
+    // reuse the current buffer when it is an untouched empty one
+    if (EC.data_rows || EC.filename || EC.dirty) editorNewBuffer();
+    if (fileExists(name)) {
+        editorOpen(name);
+        free(name);
+    } else {
+        EC.filename = name;
+    }
+    editorSetStatusMsg("buffer %d/%d: %s", EB.current + 1, EB.len,
+                       EC.filename);
+}
+
+void editorCloseBufferPrompt() {
+    if (EC.dirty) {
+        char *response = editorPrompt(
+            "Buffer has unsaved changes. close? Enter [Y]es or [N]o?%s", NULL);
+        bool yes = response && (response[0] == 'y' || response[0] == 'Y');
+        free(response);
+        if (!yes) {
+            editorSetStatusMsg("close aborted");
+            return;
+        }
+    }
+    editorCloseBuffer();
+}
+
+// open a scratch buffer listing the memory held by every buffer
+void editorMemoryReport() {
+    int count = EB.len;
+    int current = EB.current;
+    char line[160];
+    editorNewBuffer();
+    for (int i = 0; i < count; i++) {
+        struct editorConfig *b = &EB.slot[i];
+        int len = snprintf(
+            line, sizeof(line),
+            "%c%2d %-24.24s rows %9d  text %8zuK/%8zuK  render %8zuK/%8zuK  "
+            "cold %8zuK  row array %8zuK",
+            i == current ? '*' : ' ', i + 1,
+            b->filename ? b->filename : "[NO Name]", b->data_rows,
+            b->text.live / 1024, b->text.reserved / 1024,
+            b->render.live / 1024, b->render.reserved / 1024,
+            b->cold_bytes / 1024, sizeof(erow) * b->rows_cap / 1024);
+        editorInsertRow(line, len, EC.data_rows);
+    }
+    editorMarkSaved(0, EC.data_rows, 0);
+    editorSetStatusMsg("memory per buffer: live/reserved");
+}
+
+//== == == == == == == == == == == == == == == == == == == == == == == ==
+//==
+
+char *editorFindCallbackRowSearch(int *currRow, int lastMatchRow, int direction,
+                                  char *buf) {
+    // Search the chars rather than the render so that a match is a byte
+    // offset the cursor can use directly, whatever the tabs and UTF-8.
+    erow *row = &EC.row[*currRow];
+    const char *chars = editorRowChars(row);
+    int colIndex = lastMatchRow == *currRow ? EC.cx : 0;
+    char *match = NULL;
+    if (colIndex >= row->size) {
+        *currRow += direction;
+        return match;
+    }
+    if (direction == 1) {
+        if (lastMatchRow == *currRow)
+            colIndex = editorRowNextChar(row, colIndex);
+        if (colIndex >= row->size || colIndex < 0) return match;
+        match = strstr(&chars[colIndex], buf);
+    } else {
+        if (lastMatchRow != *currRow) colIndex = row->size - 1;
+        int tempIndex = 0;
+        char *prevMatch = NULL;
+        while (true) {
+            if (tempIndex >= row->size || tempIndex < 0) break;
+            match = strstr(&chars[tempIndex], buf);
+            if (match && match < &chars[colIndex]) {
+                prevMatch = match;
+                tempIndex = match - chars + 1;
+            } else {
+                break;
+            }
+        }
+        if (prevMatch) {
+            match = prevMatch;
+        } else {
+            match = NULL;
+        }
+    }
+    return match;
+}
+
+void editorFindCallback(char *buf, int c) {
+    static int last_match = -1;
+    static int direction = 1;
+
+    if (c == ARROW_DOWN || c == ARROW_RIGHT) {
+        direction = 1;
+    } else if (c == ARROW_LEFT || c == ARROW_UP) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+        if (c == '\r' || c == '\x1b') {
+            return;
+        }
+    }
+    if (last_match == -1) direction = 1;
+    int current = last_match;
+    if (current == -1 && direction == 1) current += direction;
+
+    for (int loopNum = 0; loopNum < EC.data_rows; loopNum++) {
+        if (current == EC.data_rows)
+            current = 0;
+        else if (current == -1)
+            current = EC.data_rows - 1;
+
+        char *match =
+            editorFindCallbackRowSearch(&current, last_match, direction, buf);
+
+        if (match) {
+            last_match = current;
+            EC.cy = current;
+            EC.cx = match - editorRowChars(&EC.row[current]);
+            // EC.rowoff = EC.data_rows;
+            current += direction;
+            break;
+        }
+        current += direction;
+    }
+}
+
+void editorFind() {
+    editorLoadAll();
+    int saved_cx = EC.cx;
+    int saved_cy = EC.cy;
+    char *query =
+        editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
+    if (query) {
+        free(query);
+    } else {
+        EC.cx = saved_cx;
+        EC.cy = saved_cy;
+    }
+}
+//== == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** commands ***/
+
+// growable list of rows that are not in the buffer yet
+struct rowList {
+    erow *rows;
+    int len;
+    int cap;
+};
+
+void rowListAppend(struct rowList *list, const char *data, int len) {
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        list->rows = realloc(list->rows, sizeof(erow) * list->cap);
+    }
+    editorInitRow(&list->rows[list->len++], data, len);
+}
+
+void rowListFree(struct rowList *list) {
+    for (int i = 0; i < list->len; i++) editorFreeRow(&list->rows[i]);
+    free(list->rows);
+}
+
+// append the complete lines in data to list, keeping a trailing partial
+// line in carry for the next call. Line endings are dropped as editorOpen
+// drops them, "\r\n" included.
+void rowListAppendLines(struct rowList *list, struct writeBuf *carry,
+                        char *data, int len) {
+    char *start = data;
+    char *end = data + len;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+        if (carry->len) {
+            bufAppend(carry, start, newline - start);
+            rowListAppend(list, carry->pointer,
+                          lineContentLength(carry->pointer, carry->len));
+            carry->len = 0;
+        } else {
+            rowListAppend(list, start,
+                          lineContentLength(start, newline - start));
+        }
+        start = newline + 1;
+    }
+    bufAppend(carry, start, end - start);
+}
+
+// true if the user pressed escape or ctrl-c while a long command runs. Only
+// keys already waiting are read, so the pipes are never held up by the tty.
+bool editorCancelRequested() {
+#ifdef TTE_BENCH
+    return false;
+#else
+    char c;
+    while (ttyInputPending() && ttyRead(&c) == 1) {
+        if (c == '\x1b' || c == CTRL_KEY('c')) return true;
+    }
+    return false;
+#endif
+}
+
+// Pipe rows first..last through the shell command cmd and replace them with
+// its output. Rows are streamed to the child's stdin straight from the
+// buffer while its stdout is read, both driven by poll so neither side can
+// block the other, and the screen keeps updating until the command finishes
+// or the user cancels it.
+void editorFilterRows(int first, int last, char *cmd) {
+    int toChildPipe[2];
+    int fromChildPipe[2];
+    if (pipe(toChildPipe) == -1) {
+        editorSetStatusMsg("filter failed: %s", strerror(errno));
+        return;
+    }
+    if (pipe(fromChildPipe) == -1) {
+        editorSetStatusMsg("filter failed: %s", strerror(errno));
+        close(toChildPipe[0]);
+        close(toChildPipe[1]);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);  // own group, so cancelling reaches the whole pipeline
+        dup2(toChildPipe[0], STDIN_FILENO);
+        dup2(fromChildPipe[1], STDOUT_FILENO);
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull != -1) dup2(devNull, STDERR_FILENO);
+        close(toChildPipe[0]);
+        close(toChildPipe[1]);
+        close(fromChildPipe[0]);
+        close(fromChildPipe[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    close(toChildPipe[0]);
+    close(fromChildPipe[1]);
+    int toChild = toChildPipe[1];
+    int fromChild = fromChildPipe[0];
+    if (pid == -1) {
+        close(toChild);
+        close(fromChild);
+        editorSetStatusMsg("filter failed: %s", strerror(errno));
+        return;
+    }
+    setpgid(pid, pid);  // as the child does, whichever of us runs first
+    fcntl(toChild, F_SETFL, fcntl(toChild, F_GETFL) | O_NONBLOCK);
+    fcntl(fromChild, F_SETFL, fcntl(fromChild, F_GETFL) | O_NONBLOCK);
+    // a command that stops reading early must not kill the editor
+    void (*oldSigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    char *stage = malloc(TTE_FILTER_CHUNK);  // bytes on their way out
+    int stageLen = 0;
+    int stageOff = 0;
+    int sendRow = first;  // next row to copy into stage
+    int sendOff = 0;      // bytes of sendRow already copied
+    char *chunk = malloc(TTE_FILTER_CHUNK);
+    struct rowList out = {NULL, 0, 0};
+    struct writeBuf carry = WRITEBUF_INIT;
+    bool cancelled = false;
+    long long lastDraw = monotonicNs();
+    int eol = editorLineEndLength();  // sent as the file has them
+#ifdef TTE_BENCH
+    int keyFd = -1;  // poll skips it, the scripted keys are not a tty
+#else
+    int keyFd = STDIN_FILENO;  // wake up as soon as a key is pressed
+#endif
+
+    while (fromChild != -1) {
+        if (toChild != -1 && stageOff == stageLen) {
+            stageLen = 0;
+            stageOff = 0;
+            while (stageLen < TTE_FILTER_CHUNK && sendRow <= last) {
+                erow *row = &EC.row[sendRow];
+                if (sendOff < row->size) {
+                    int n = row->size - sendOff;
+                    if (n > TTE_FILTER_CHUNK - stageLen)
+                        n = TTE_FILTER_CHUNK - stageLen;
+                    memcpy(&stage[stageLen], &row->chars[sendOff], n);
+                    stageLen += n;
+                    sendOff += n;
+                } else if (stageLen + eol <= TTE_FILTER_CHUNK) {
+                    if (eol == 2) stage[stageLen++] = '\r';
+                    stage[stageLen++] = '\n';
+                    sendRow++;
+                    sendOff = 0;
+                } else {
+                    break;  // the line ending goes out with the next chunk
+                }
+            }
+            if (stageLen == 0) {
+                close(toChild);  // everything sent, let the command finish
+                toChild = -1;
+            }
+        }
+
+        struct pollfd fds[3] = {{fromChild, POLLIN, 0}, {keyFd, POLLIN, 0},
+                                {toChild, POLLOUT, 0}};
+        poll(fds, toChild != -1 ? 3 : 2, TTE_FILTER_REDRAW_MS);
+        if (fds[1].revents && editorCancelRequested()) {
+            cancelled = true;
+            break;
+        }
+        if (toChild != -1 && fds[2].revents) {
+            ssize_t n = write(toChild, &stage[stageOff], stageLen - stageOff);
+            if (n > 0) {
+                stageOff += n;
+            } else if (n == -1 && errno != EAGAIN) {
+                close(toChild);  // the command stopped reading
+                toChild = -1;
+            }
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(fromChild, chunk, TTE_FILTER_CHUNK);
+            if (n > 0) {
+                rowListAppendLines(&out, &carry, chunk, n);
+            } else if (n == 0 || errno != EAGAIN) {
+                close(fromChild);
+                fromChild = -1;
+            }
+        }
+
+        if (monotonicNs() - lastDraw > TTE_FILTER_REDRAW_MS * 1000000LL) {
+            editorSetStatusMsg(
+                "filtering: %d/%d rows sent, %d received (ESC to cancel)",
+                sendRow - first, last - first + 1, out.len);
+            editorRefreshScreen();
+            lastDraw = monotonicNs();
+        }
+    }
+    if (carry.len)
+        rowListAppend(&out, carry.pointer,
+                      lineContentLength(carry.pointer, carry.len));
+
+    if (toChild != -1) close(toChild);
+    if (fromChild != -1) close(fromChild);
+    if (cancelled) kill(-pid, SIGTERM);  // sh and everything it started
+    int status = 0;
+    waitpid(pid, &status, 0);
+    signal(SIGPIPE, oldSigpipe);
+    free(stage);
+    free(chunk);
+    bufFree(&carry);
+
+    if (cancelled) {
+        rowListFree(&out);
+        editorSetStatusMsg("filter cancelled");
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        rowListFree(&out);
+        editorSetStatusMsg("filter failed: command exited with %d",
+                           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    } else {
+        struct undoRecord undo = undoBegin(UNDO_REPLACE);
+        undo.first = first;
+        undo.count = out.len;
+        undo.len = last - first + 1;
+        undo.rows = malloc(sizeof(erow) * undo.len);
+        editorReplaceRows(first, undo.len, out.rows, out.len, undo.rows);
+        undoKeep(&undo);
+        free(out.rows);
+        editorSetStatusMsg("filtered %d lines into %d", last - first + 1,
+                           out.len);
+        logInfo("filter '%s': %d lines into %d", cmd, last - first + 1,
+                out.len);
+    }
+}
+
+// number of threads to split items of work across; small jobs stay on the
+// calling thread
+int editorWorkerCount(int items) {
+    if (items < TTE_PARALLEL_MIN) return 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = 1;
+    while (workers * 2 <= cpus && workers * 2 <= TTE_MAX_WORKERS) workers *= 2;
+    return workers;
+}
+
+// run fn on each of count jobs of size bytes, one thread per job, with the
+// first job on the calling thread
+void runParallel(void *(*fn)(void *), void *jobs, size_t size, int count) {
+    pthread_t threads[TTE_MAX_WORKERS];
+    bool started[TTE_MAX_WORKERS] = {false};
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, fn,
+                                    (char *)jobs + i * size) == 0;
+        if (!started[i]) fn((char *)jobs + i * size);
+    }
+    if (count > 0) fn(jobs);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+// A row to sort. The first eight bytes of the line are packed big endian
+// into prefix so most comparisons never touch the row text.
+struct sortKey {
+    uint64_t prefix;
+    erow *row;
+};
+
+int sortKeyCompare(const struct sortKey *a, const struct sortKey *b) {
+    if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+    int minLen = a->row->size < b->row->size ? a->row->size : b->row->size;
+    int cmp = memcmp(a->row->chars, b->row->chars, minLen);
+    if (cmp) return cmp;
+    return (a->row->size > b->row->size) - (a->row->size < b->row->size);
+}
+
+// merge the sorted runs keys[lo, mid) and keys[mid, hi) through tmp
+void sortKeysMerge(struct sortKey *keys, struct sortKey *tmp, int lo, int mid,
+                   int hi, int order) {
+    int i = lo;
+    int j = mid;
+    int out = lo;
+    while (i < mid && j < hi) {
+        if (sortKeyCompare(&keys[j], &keys[i]) * order < 0)
+            tmp[out++] = keys[j++];
+        else
+            tmp[out++] = keys[i++];
+    }
+    while (i < mid) tmp[out++] = keys[i++];
+    while (j < hi) tmp[out++] = keys[j++];
+    memcpy(&keys[lo], &tmp[lo], sizeof(struct sortKey) * (hi - lo));
+}
+
+// stable merge sort of keys[lo, hi), ascending for order 1 and descending
+// for order -1
+void sortKeysRange(struct sortKey *keys, struct sortKey *tmp, int lo, int hi,
+                   int order) {
+    if (hi - lo <= 16) {
+        for (int i = lo + 1; i < hi; i++) {
+            struct sortKey key = keys[i];
+            int j = i;
+            while (j > lo && sortKeyCompare(&key, &keys[j - 1]) * order < 0) {
+                keys[j] = keys[j - 1];
+                j--;
+            }
+            keys[j] = key;
+        }
+        return;
+    }
+    int mid = lo + (hi - lo) / 2;
+    sortKeysRange(keys, tmp, lo, mid, order);
+    sortKeysRange(keys, tmp, mid, hi, order);
+    if (sortKeyCompare(&keys[mid - 1], &keys[mid]) * order <= 0) return;
+    sortKeysMerge(keys, tmp, lo, mid, hi, order);
+}
+
+struct sortJob {
+    struct sortKey *keys;
+    struct sortKey *tmp;
+    int lo;
+    int mid;  // -1 for a job that sorts [lo, hi) rather than merging
+    int hi;
+    int order;
+};
+
+void *sortWorker(void *arg) {
+    struct sortJob *job = arg;
+    for (int i = job->lo; job->mid == -1 && i < job->hi; i++) {
+        const unsigned char *chars = (unsigned char *)job->keys[i].row->chars;
+        int len = job->keys[i].row->size < 8 ? job->keys[i].row->size : 8;
+        uint64_t prefix = 0;
+        for (int b = 0; b < 8; b++) {
+            prefix = (prefix << 8) | (b < len ? chars[b] : 0);
+        }
+        job->keys[i].prefix = prefix;
+    }
+    if (job->mid == -1)
+        sortKeysRange(job->keys, job->tmp, job->lo, job->hi, job->order);
+    else
+        sortKeysMerge(job->keys, job->tmp, job->lo, job->mid, job->hi,
+                      job->order);
+    return NULL;
+}
+
+// Sort rows first..last. Each worker sorts one slice of the keys, the
+// slices are merged pairwise in parallel, and then the erow structs are
+// permuted into place; the row text itself is never copied.
+void editorSortRows(int first, int last, int order) {
+    int n = last - first + 1;
+    struct sortKey *keys = malloc(sizeof(struct sortKey) * n);
+    struct sortKey *tmp = malloc(sizeof(struct sortKey) * n);
+    for (int i = 0; i < n; i++) keys[i].row = &EC.row[first + i];
+
+    int workers = editorWorkerCount(n);
+    int bound[TTE_MAX_WORKERS + 1];
+    struct sortJob jobs[TTE_MAX_WORKERS];
+    for (int i = 0; i <= workers; i++) bound[i] = (long long)n * i / workers;
+    for (int i = 0; i < workers; i++) {
+        jobs[i] = (struct sortJob){keys, tmp, bound[i], -1, bound[i + 1], order};
+    }
+    runParallel(sortWorker, jobs, sizeof(struct sortJob), workers);
+    for (int width = 1; width < workers; width *= 2) {
+        int count = 0;
+        for (int i = 0; i + width < workers; i += 2 * width) {
+            int end = i + 2 * width < workers ? i + 2 * width : workers;
+            jobs[count++] = (struct sortJob){keys, tmp, bound[i],
+                                             bound[i + width], bound[end],
+                                             order};
+        }
+        runParallel(sortWorker, jobs, sizeof(struct sortJob), count);
+    }
+
+    // follow the cycles of the permutation so only one erow is held aside
+    int *from = (int *)tmp;
+    for (int i = 0; i < n; i++) from[i] = keys[i].row - &EC.row[first];
+    free(keys);
+    struct undoRecord undo = undoBegin(UNDO_ORDER);
+    undo.first = first;
+    undo.count = n;
+    undo.at = malloc(sizeof(int) * n);
+    memcpy(undo.at, from, sizeof(int) * n);
+    erow *rows = &EC.row[first];
+    for (int i = 0; i < n; i++) {
+        if (from[i] == i || from[i] == -1) continue;
+        erow held = rows[i];
+        int j = i;
+        while (from[j] != i) {
+            int next = from[j];
+            rows[j] = rows[next];
+            from[j] = -1;
+            j = next;
+        }
+        rows[j] = held;
+        from[j] = -1;
+    }
+    free(tmp);
+    EC.offsets.valid = false;
+    editorRowsMoved();
+    undoKeep(&undo);
+}
+
+struct lineFilterJob {
+    int lo;  // rows [lo, hi) of the buffer to decide on
+    int hi;
+    int first;
+    const char *pattern;  // NULL to drop rows equal to the one before
+    int patternLen;
+    bool invert;
+    char *keep;  // one flag per row from first on
+};
+
+void *lineFilterWorker(void *arg) {
+    struct lineFilterJob *job = arg;
+    for (int i = job->lo; i < job->hi; i++) {
+        erow *row = &EC.row[i];
+        bool keep;
+        if (job->pattern) {
+            keep = memmem(row->chars, row->size, job->pattern,
+                          job->patternLen) != NULL;
+            keep = keep != job->invert;
+        } else {
+            erow *prev = &EC.row[i - 1];
+            keep = i == job->first || row->size != prev->size ||
+                   memcmp(row->chars, prev->chars, row->size) != 0;
+        }
+        job->keep[i - job->first] = keep;
+    }
+    return NULL;
+}
+
+// Drop rows first..last that do not contain pattern (or do, with invert),
+// or with a NULL pattern the rows that repeat the row before them. Rows are
+// checked in parallel and the survivors compacted in one pass. Returns the
+// number of rows removed.
+int editorFilterLines(int first, int last, const char *pattern, bool invert) {
+    int n = last - first + 1;
+    char *keep = malloc(n);
+    int workers = editorWorkerCount(n);
+    struct lineFilterJob jobs[TTE_MAX_WORKERS];
+    for (int i = 0; i < workers; i++) {
+        jobs[i] = (struct lineFilterJob){
+            first + (int)((long long)n * i / workers),
+            first + (int)((long long)n * (i + 1) / workers),
+            first,
+            pattern,
+            pattern ? strlen(pattern) : 0,
+            invert,
+            keep};
+    }
+    runParallel(lineFilterWorker, jobs, sizeof(struct lineFilterJob), workers);
+
+    struct undoRecord undo = undoBegin(UNDO_REMOVE);
+    int out = first;
+    for (int i = first; i <= last; i++) {
+        if (keep[i - first])
+            EC.row[out++] = EC.row[i];
+        else
+            undoAddRow(&undo, &EC.row[i], i);
+    }
+    free(keep);
+    int removed = last + 1 - out;
+    memmove(&EC.row[out], &EC.row[last + 1],
+            sizeof(erow) * (EC.data_rows - last - 1));
+    EC.data_rows -= removed;
+    if (removed) {
+        EC.offsets.valid = false;
+        editorRowsMoved();
+    }
+    undo.first = first;
+    undo.count = out - first;
+    if (removed)
+        undoKeep(&undo);
+    else
+        undoFree(&undo);
+    return removed;
+}
+
+// parse one line address: a number, '.' for the cursor row or '$' for the
+// last row. Returns the 0-based row, or -1 if there is none at *cmd.
+int editorParseAddress(char **cmd) {
+    char *p = *cmd;
+    if (*p == '.') {
+        *cmd = p + 1;
+        return EC.cy;
+    }
+    if (*p == '$') {
+        *cmd = p + 1;
+        return EC.data_rows - 1;
+    }
+    if (!isdigit((unsigned char)*p)) return -1;
+    int line = strtol(p, cmd, 10);
+    return line > 0 ? line - 1 : 0;
+}
+
+// Parse an optional range in front of a command: "%" for the whole buffer,
+// "N" or "N,M" for lines. Without one the range is the rows spanned by the
+// cursors when there are extra cursors, otherwise the whole buffer.
+char *editorParseRange(char *cmd, int *first, int *last) {
+    while (*cmd == ' ') cmd++;
+    *first = 0;
+    *last = EC.data_rows - 1;
+    if (*cmd == '%') return cmd + 1;
+    int start = editorParseAddress(&cmd);
+    if (start == -1) {
+        if (EC.num_cursors) {
+            *first = EC.cy < EC.cursors[0].cy ? EC.cy : EC.cursors[0].cy;
+            *last = EC.cursors[EC.num_cursors - 1].cy;
+            if (EC.cy > *last) *last = EC.cy;
+        }
+        return cmd;
+    }
+    int end = start;
+    if (*cmd == ',') {
+        cmd++;
+        end = editorParseAddress(&cmd);
+        if (end == -1) end = start;
+    }
+    *first = start < end ? start : end;
+    *last = start < end ? end : start;
+    return cmd;
+}
+
+// keep the cursor inside the buffer after rows were replaced or removed
+void editorClampCursor() {
+    if (EC.cy > EC.data_rows) EC.cy = EC.data_rows;
+    int rowLen = EC.cy < EC.data_rows ? EC.row[EC.cy].size : 0;
+    if (EC.cx > rowLen) EC.cx = rowLen;
+}
+
+// if cmd starts with the word name, return what follows it, else NULL
+char *editorCommandArgs(char *cmd, const char *name) {
+    size_t len = strlen(name);
+    if (strncmp(cmd, name, len) != 0) return NULL;
+    if (cmd[len] != '\0' && cmd[len] != ' ') return NULL;
+    cmd += len;
+    while (*cmd == ' ') cmd++;
+    return cmd;
+}
+
+// Move the cursor to where: a line number, a percentage of the buffer's
+// bytes like 50%, or a byte offset like @4096. Returns false if where is
+// none of these.
+bool editorGoto(const char *where) {
+    char *end;
+    int row;
+    long long column = 0;
+    if (*where == '@' || strchr(where, '%')) {
+        long long offset = 0;
+        double percent = -1;
+        if (*where == '@') {
+            offset = strtoll(where + 1, &end, 10);
+            if (end == where + 1 || *end != '\0' || offset < 0) return false;
+        } else {
+            percent = strtod(where, &end);
+            if (end == where || strcmp(end, "%") != 0 || !isfinite(percent) ||
+                percent < 0 || percent > 100)
+                return false;
+        }
+        editorLoadAll();
+        struct byteIndex *index = editorByteIndex();
+        long long total = byteIndexPrefix(index, index->n);
+        if (percent >= 0) offset = total * (percent / 100);
+        if (offset >= total) offset = total ? total - 1 : 0;
+        row = byteIndexFind(index, offset, &column);
+    } else {
+        long line = strtol(where, &end, 10);
+        if (end == where || *end != '\0') return false;
+        if (line > INT_MAX - EC.screen_rows) line = INT_MAX - EC.screen_rows;
+        editorLoadRows(line + EC.screen_rows);  // only as far as the view
+        row = line < 1 ? 0 : line - 1;
+    }
+    if (row >= EC.data_rows) row = EC.data_rows ? EC.data_rows - 1 : 0;
+
+    EC.cy = row;
+    EC.cx = 0;
+    if (row < EC.data_rows) {
+        erow *r = &EC.row[row];
+        const char *chars = editorRowChars(r);
+        EC.cx = column < r->size ? column : r->size;
+        while (EC.cx > 0 && utf8IsContinuation(chars[EC.cx])) EC.cx--;
+    }
+    editorClearCursors();
+    EC.rowoff = EC.cy - EC.screen_rows / 2;  // land in the middle of the view
+    if (EC.rowoff < 0) EC.rowoff = 0;
+    // a line goto shows the byte only if the index is there to tell it
+    if (row < EC.data_rows && EC.offsets.valid) {
+        long long offset = byteIndexPrefix(editorByteIndex(), row) + EC.cx;
+        editorSetStatusMsg("line %d of %d, byte %lld", EC.cy + 1,
+                           EC.data_rows, offset);
+    } else {
+        editorSetStatusMsg("line %d of %d", EC.cy + 1, EC.data_rows);
+    }
+    return true;
+}
+
+void editorGotoPrompt() {
+    char *where = editorPrompt("goto: %s (line, N%% or @byte offset)", NULL);
+    if (where == NULL) return;
+    if (!editorGoto(where)) editorSetStatusMsg("not a line, N%% or @offset");
+    free(where);
+}
+
+// Run a command typed at the command prompt: an optional range followed by
+// one of
+//   !command       filter the rows through an external command
+//   sort [-r]      sort the rows
+//   uniq           drop rows equal to the row before them
+//   grep [-v] pat  keep only the rows containing (or not containing) pat
+// or goto followed by what editorGoto takes.
+void editorRunCommand(char *cmd) {
+    char *args = editorCommandArgs(cmd, "goto");
+    if (args) {
+        if (!editorGoto(args)) editorSetStatusMsg("usage: goto line|N%%|@offset");
+        return;
+    }
+    editorLoadAll();
+    editorThawAll();
+    int first;
+    int last;
+    char *rest = editorParseRange(cmd, &first, &last);
+    if (last >= EC.data_rows) last = EC.data_rows - 1;
+    while (*rest == ' ') rest++;
+    if (first > last) {
+        editorSetStatusMsg("no lines in range");
+        return;
+    }
+    editorClearCursors();
+    long long start = monotonicNs();
+
+    if (*rest == '!') {
+        editorFilterRows(first, last, rest + 1);
+    } else if ((args = editorCommandArgs(rest, "sort")) != NULL) {
+        editorSortRows(first, last, strcmp(args, "-r") == 0 ? -1 : 1);
+        editorSetStatusMsg("sorted %d lines in %lld ms", last - first + 1,
+                           (monotonicNs() - start) / 1000000);
+    } else if ((args = editorCommandArgs(rest, "uniq")) != NULL) {
+        int removed = editorFilterLines(first, last, NULL, false);
+        editorSetStatusMsg("removed %d duplicate lines in %lld ms", removed,
+                           (monotonicNs() - start) / 1000000);
+    } else if ((args = editorCommandArgs(rest, "grep")) != NULL) {
+        bool invert = editorCommandArgs(args, "-v") != NULL;
+        if (invert) args = editorCommandArgs(args, "-v");
+        if (*args == '\0') {
+            editorSetStatusMsg("usage: grep [-v] pattern");
+            return;
+        }
+        int removed = editorFilterLines(first, last, args, invert);
+        editorSetStatusMsg("kept %d of %d lines in %lld ms",
+                           last - first + 1 - removed, last - first + 1,
+                           (monotonicNs() - start) / 1000000);
+    } else {
+        editorSetStatusMsg("unknown command: %s", rest);
+        return;
+    }
+    editorClampCursor();
+}
+
+void editorCommandPrompt() {
+    char *cmd = editorPrompt(":%s", NULL);
+    if (cmd == NULL) return;
+    editorRunCommand(cmd);
+    free(cmd);
+}
+
+//== == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** file watching ***/
+
+// Files changed by other programs are noticed through inotify on the
+// directory of each open file, which also sees a file being replaced by a
+// rename. An event only flags the buffer for a check; whether the file
+// really changed is decided by its stat stamp, so our own saves are ignored.
+
+struct fileStamp fileStampOf(const struct stat *st) {
+    struct fileStamp stamp = {st->st_dev, st->st_ino, st->st_size,
+                              st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+    return stamp;
+}
+
+bool fileStampEqual(struct fileStamp a, struct fileStamp b) {
+    return a.dev == b.dev && a.ino == b.ino && a.size == b.size &&
+           a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec;
+}
+
+// the part of path after its last slash
+const char *fileBaseName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Drop the watch of the current buffer. Buffers in the same directory share
+// one watch, so it is only removed from inotify when it was the last one.
+void editorUnwatchFile() {
+    if (EC.watch == -1) return;
+    bool shared = false;
+    for (int i = 0; i < EB.len; i++) {
+        if (i != EB.current && EB.slot[i].watch == EC.watch) shared = true;
+    }
+    if (!shared) inotify_rm_watch(inotifyFd, EC.watch);
+    EC.watch = -1;
+}
+
+// watch the directory of the file, moving the watch if the buffer was saved
+// under another name
+void editorWatchFile() {
+    if (inotifyFd == -1) inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd == -1 || EC.filename == NULL) return;
+    const char *base = fileBaseName(EC.filename);
+    char *dir = base == EC.filename
+                    ? strdup(".")
+                    : strndup(EC.filename, base - EC.filename);
+    int watch = inotify_add_watch(inotifyFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watch == -1) logWarn("cannot watch %s: %s", dir, strerror(errno));
+    if (watch != EC.watch) editorUnwatchFile();
+    EC.watch = watch;
+    free(dir);
+}
+
+// remember the file open on fd as the version the buffer matches
+void editorStampFile(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) EC.disk = fileStampOf(&st);
+    EC.disk_changed = false;
+    if (!batchMode) editorWatchFile();  // batch files are edited once
+}
+
+// flag the buffers whose file is name in the directory watched by wd
+void editorFlagFileEvent(int wd, const char *name) {
+    for (int i = 0; i < EB.len; i++) {
+        struct editorConfig *buf = i == EB.current ? &EC : &EB.slot[i];
+        if (buf->watch == wd && buf->filename &&
+            strcmp(fileBaseName(buf->filename), name) == 0) {
+            buf->disk_check = true;
+        }
+    }
+}
+
+void editorReadFileEvents() {
+    union {
+        struct inotify_event event;
+        char bytes[4096];
+    } buf;
+    ssize_t len;
+    while ((len = read(inotifyFd, buf.bytes, sizeof(buf.bytes))) > 0) {
+        for (char *p = buf.bytes; p < buf.bytes + len;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len) editorFlagFileEvent(event->wd, event->name);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+void reloadJobAddLine(void *ctx, long long offset, char *line, int len) {
+    struct reloadJob *job = ctx;
+    lineIndexAdd(&job->index, offset,
+                 rowHash(line, lineContentLength(line, len)));
+}
+
+// Hash every line of the file, split the same way editorOpen splits it.
+// Runs on its own thread so the editor stays responsive on huge files.
+void *reloadWorker(void *arg) {
+    struct reloadJob *job = arg;
+    struct stat st;
+    job->failed = fstat(job->fd, &st) == -1;
+    job->stamp = fileStampOf(&st);
+    long long size = readLines(job->fd, reloadJobAddLine, job);
+    if (size == -1) job->failed = true;
+    lineIndexEnd(&job->index, size);
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void editorStartReload() {
+    if (EC.reload || EC.filename == NULL) return;
+    int fd = open(EC.filename, O_RDONLY);
+    if (fd == -1) {
+        editorSetStatusMsg("Cannot reload %s: %s", EC.filename,
+                           strerror(errno));
+        return;
+    }
+    struct reloadJob *job = calloc(1, sizeof(struct reloadJob));
+    job->fd = fd;
+    if (pthread_create(&job->thread, NULL, reloadWorker, job) != 0) {
+        close(fd);
+        free(job);
+        return;
+    }
+    EC.reload = job;
+}
+
+// wait for the reload of the current buffer and take it over
+struct reloadJob *editorTakeReload() {
+    struct reloadJob *job = EC.reload;
+    pthread_join(job->thread, NULL);
+    EC.reload = NULL;
+    return job;
+}
+
+void editorFreeReload(struct reloadJob *job) {
+    close(job->fd);
+    lineIndexFree(&job->index);
+    free(job);
+}
+
+// Make the buffer match the file the worker hashed. Only the rows between
+// the longest common prefix and suffix of line hashes are read again and
+// replaced, and the cursor stays on the same text around the change.
+void editorApplyReload(struct reloadJob *job) {
+    editorLoadAll();
+    struct stat st;
+    if (job->failed || fstat(job->fd, &st) == -1 ||
+        !fileStampEqual(fileStampOf(&st), job->stamp)) {
+        EC.disk_check = true;  // written again while it was read, retry
+        return;
+    }
+    long long start = monotonicNs();
+    struct lineIndex *index = &job->index;
+    int prefix;
+    int oldEnd;
+    int newEnd;
+    editorChangedRange(index, &prefix, &oldEnd, &newEnd);
+
+    struct rowList fresh = {NULL, 0, 0};
+    if (newEnd > prefix) {
+        long long from = index->offset[prefix];
+        size_t size = index->offset[newEnd] - from;
+        char *text = malloc(size);
+        size_t got = 0;
+        ssize_t n = 1;
+        while (got < size && (n = pread(job->fd, text + got, size - got,
+                                        from + got)) > 0) {
+            got += n;
+        }
+        if (got < size) {
+            free(text);
+            EC.disk_check = true;
+            return;
+        }
+        for (int i = prefix; i < newEnd; i++) {
+            char *line = text + (index->offset[i] - from);
+            int len = index->offset[i + 1] - index->offset[i];
+            rowListAppend(&fresh, line, lineContentLength(line, len));
+        }
+        free(text);
+    }
+
+    editorClearCursors();
+    editorReplaceRows(prefix, oldEnd - prefix, fresh.rows, fresh.len, NULL);
+    free(fresh.rows);
+    int shift = fresh.len - (oldEnd - prefix);
+    if (EC.cy >= oldEnd)
+        EC.cy += shift;
+    else if (EC.cy > prefix + fresh.len)
+        EC.cy = prefix + fresh.len;
+    if (EC.rowoff >= oldEnd) EC.rowoff += shift;
+    if (EC.rowoff > EC.data_rows) EC.rowoff = EC.data_rows;
+    editorClampCursor();
+
+    EC.disk = job->stamp;
+    EC.disk_changed = false;
+    lineIndexFree(&EC.saved);
+    EC.saved = *index;
+    memset(index, 0, sizeof(*index));
+    EC.rows_differ = 0;
+    EC.rows_moved = false;
+    EC.dirty = false;
+    editorDetectLineEnding();
+    editorSetStatusMsg("reloaded %s: %d lines replaced",
+                       fileBaseName(EC.filename), fresh.len);
+    logInfo("reloaded %s: rows %d-%d replaced by %d in %lld us", EC.filename,
+            prefix, oldEnd, fresh.len, (monotonicNs() - start) / 1000);
+}
+
+// Look for changes to the file of the current buffer while waiting for a
+// key. Unmodified buffers are reloaded, modified ones only get a warning.
+// Returns true when the screen needs to be redrawn.
+bool editorCheckDisk() {
+    if (inotifyFd == -1 || promptDepth) return false;
+    editorReadFileEvents();
+    if (EC.reload) {
+        if (!__atomic_load_n(&EC.reload->done, __ATOMIC_ACQUIRE)) return false;
+        struct reloadJob *job = editorTakeReload();
+        if (EC.dirty) {
+            EC.disk_changed = true;  // edited while the file was being read
+            editorSetStatusMsg(
+                "WARNING!!! %s changed on disk. CTRL-r to reload",
+                fileBaseName(EC.filename));
+        } else {
+            editorApplyReload(job);
+        }
+        editorFreeReload(job);
+        return true;
+    }
+    if (!EC.disk_check) return false;
+    EC.disk_check = false;
+    struct stat st;
+    if (EC.filename == NULL || stat(EC.filename, &st) == -1) return false;
+    if (fileStampEqual(fileStampOf(&st), EC.disk)) return false;
+    if (EC.dirty) {
+        EC.disk_changed = true;
+        editorSetStatusMsg("WARNING!!! %s changed on disk. CTRL-r to reload",
+                           fileBaseName(EC.filename));
+        return true;
+    }
+    editorStartReload();
+    return false;
+}
+
+void editorReload() {
+    if (EC.filename == NULL || !fileExists(EC.filename)) {
+        editorSetStatusMsg("Nothing to reload");
+        return;
+    }
+    if (EC.dirty) {
+        char *response = editorPrompt(
+            "Discard unsaved changes and reload? Enter [Y]es or [N]o?%s",
+            NULL);
+        bool yes = response && (response[0] == 'y' || response[0] == 'Y');
+        free(response);
+        if (!yes) {
+            editorSetStatusMsg("reload aborted");
+            return;
+        }
+    }
+    editorStartReload();
+    if (EC.reload == NULL) return;
+    struct reloadJob *job = editorTakeReload();
+    editorApplyReload(job);
+    editorFreeReload(job);
+}
+
+//== == == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** output ***/
+void clearLineRight(struct writeBuf *wBuf) { bufAppend(wBuf, "\x1b[K", 3); }
+
+// append the decimal digits of n to p
+char *putDecimal(char *p, unsigned int n) {
+    char digits[10];
+    int len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (len) *p++ = digits[--len];
+    return p;
+}
+
+uint64_t keyMix(uint64_t key, uint64_t value) {
+    key = (key ^ value) * 0x9e3779b97f4a7c15ULL;
+    return key ^ (key >> 32);
+}
+
+// forget what the terminal shows, so the next frame draws everything
+void editorInvalidateScreen() {
+    SC.lines = EC.screen_rows + 2;
+    SC.line = realloc(SC.line, sizeof(uint64_t) * SC.lines);
+    SC.drawn = realloc(SC.drawn, sizeof(bool) * SC.lines);
+    memset(SC.line, 0, sizeof(uint64_t) * SC.lines);
+    SC.attr_known = false;
+}
+
+// Whether screen line y has to be sent because it shows something other
+// than key. If so the cursor is moved to the start of the line.
+bool editorScreenLine(struct writeBuf *wBuf, int y, uint64_t key) {
+    if (key == 0) key = 1;  // 0 marks a line whose content is unknown
+    if (SC.line[y] == key) return false;
+    SC.line[y] = key;
+    SC.drawn[y] = true;
+    if (SC.cursor_line != y) {
+        char buf[16] = "\x1b[";
+        char *p = buf + 2;
+        if (y) p = putDecimal(p, y + 1);
+        *p++ = 'H';
+        bufAppend(wBuf, buf, p - buf);
+    }
+    SC.cursor_line = y + 1;  // every line but the last ends in "\r\n"
+    return true;
+}
+
+// send line, the drawing of screen line y, unless the terminal shows it
+// already. line is emptied for reuse.
+void editorPutLine(struct writeBuf *wBuf, int y, struct writeBuf *line) {
+    if (editorScreenLine(wBuf, y, rowHash(line->pointer, line->len)))
+        bufAppend(wBuf, line->pointer, line->len);
+    line->len = 0;
+}
+
+void printWelcomeMsg(struct writeBuf *wBuf) {
+    char welcome[80];
+    int welcomelen =
+        snprintf(welcome, sizeof(welcome), "Terminal Text editor -- version %s",
+                 TTE_VERSION);
+    if (welcomelen > EC.screen_cols) {
+        welcomelen = EC.screen_cols;
+    }
+    int padding = (EC.screen_cols - welcomelen) / 2;
+    if (padding) {
+        bufAppend(wBuf, "~", 1);
+        padding--;
+    }
+    while (padding--) bufAppend(wBuf, " ", 1);
+    bufAppend(wBuf, welcome, welcomelen);
+}
+
+void editorDrawStatusBar(struct writeBuf *wBuf) {
+    // Invert Foreground and background color for status bar
+    editorAppendClrToBuf(wBuf, INVERT_FG_BG, 0, 0, 0);
+
+    int totalCols = EC.screen_cols + TTE_SIDE_PANEL_WIDTH;
+    const int LINE_NUM_LEN = 9;
+    char *status = malloc(totalCols + 1);
+
+    const char *dirty = EC.dirty ? "*" : " ";
+    const char *fileName = EC.filename ? EC.filename : "[NO Name]";
+    const char *longFNDots =
+        (EC.filename && strlen(EC.filename) > TTE_MAX_FILENAME_DISPLAYED)
+            ? "..."
+            : "";
+
+    // Limit FileNameLen to 20 characters.
+    int fileNameLen = strlen(fileName);
+    fileNameLen = fileNameLen > TTE_MAX_FILENAME_DISPLAYED
+                      ? TTE_MAX_FILENAME_DISPLAYED - 3
+                      : fileNameLen;
+
+    int len = strlen(dirty) + fileNameLen + strlen(longFNDots);
+    int spaces = totalCols - LINE_NUM_LEN - len;
+
+    // Profiling overlay sits just left of the cursor position, if it fits.
+    char perf[64];
+    int perfLen = PS.overlay ? perfOverlay(perf, sizeof(perf)) : 0;
+    if (perfLen > spaces) perfLen = 0;
+    spaces -= perfLen;
+
+    len = snprintf(status, totalCols + 1, "%s%.*s%.03s%*s%.*s<%3d:%-3d ", dirty,
+                   fileNameLen, fileName, longFNDots, spaces, "", perfLen,
+                   perf, EC.cy + 1, EC.rx + 1);
+    if (len > totalCols) len = totalCols;
+
+    bufAppend(wBuf, status, len);
+    free(status);
+    // Reset all graphical rendering settings to default.
+    editorAppendClrToBuf(wBuf, RESET, 0, 0, 0);
+    bufAppend(wBuf, "\r\n", 2);
+}
+
+void editorDrawStatusMsgBar(struct writeBuf *wBuf) {
+    clearLineRight(wBuf);
+    int msgLen = strlen(EC.status_msg);
+    if (msgLen > EC.screen_cols - 2) msgLen = EC.screen_cols - 2;
+    int timeLeft = time(NULL) - EC.status_msg_time;
+    bufAppend(wBuf, " ", 1);
+    if (msgLen && timeLeft < 5) bufAppend(wBuf, EC.status_msg, msgLen);
+}
+
+// append the SGR parameters selecting color rgb, or the default color, for
+// base 38 (foreground) or 48 (background)
+char *sgrPutColor(char *p, int base, int rgb) {
+    if (rgb == -1) return putDecimal(p, base + 1);
+    p = putDecimal(p, base);
+    memcpy(p, ";2;", 3);
+    p = putDecimal(p + 3, rgb >> 16 & 0xff);
+    *p++ = ';';
+    p = putDecimal(p, rgb >> 8 & 0xff);
+    *p++ = ';';
+    return putDecimal(p, rgb & 0xff);
+}
+
+// bring the terminal to rendition want, sending only what differs from the
+// rendition it is in
+void editorSetRendition(struct writeBuf *wBuf, struct sgrState want) {
+    struct sgrState have = SC.attr;
+    if (SC.attr_known && want.fg == have.fg && want.bg == have.bg &&
+        want.invert == have.invert) {
+        return;
+    }
+    char seq[64] = "\x1b[";
+    char *p = seq + 2;
+    bool plain = want.fg == -1 && want.bg == -1 && !want.invert;
+    if (plain || !SC.attr_known) {
+        // start over from the default, which "\x1b[m" alone selects
+        if (!plain) *p++ = '0';
+        have.fg = have.bg = -1;
+        have.invert = false;
+    }
+    if (want.fg != have.fg) {
+        if (p > seq + 2) *p++ = ';';
+        p = sgrPutColor(p, FOREGROUND, want.fg);
+    }
+    if (want.bg != have.bg) {
+        if (p > seq + 2) *p++ = ';';
+        p = sgrPutColor(p, BACKGROUND, want.bg);
+    }
+    if (want.invert != have.invert) {
+        if (p > seq + 2) *p++ = ';';
+        p = want.invert ? putDecimal(p, INVERT_FG_BG) : putDecimal(p, 27);
+    }
+    *p++ = 'm';
+    bufAppend(wBuf, seq, p - seq);
+    SC.attr = want;
+    SC.attr_known = true;
+}
+
+void editorAppendClrToBuf(struct writeBuf *wBuf, int code, int r, int g,
+                          int b) {
+    struct sgrState want = SC.attr;
+    if (!SC.attr_known) {
+        want.fg = want.bg = -1;
+        want.invert = false;
+    }
+    switch (code) {
+        case FOREGROUND:
+            want.fg = r << 16 | g << 8 | b;
+            break;
+        case BACKGROUND:
+            want.bg = r << 16 | g << 8 | b;
+            break;
+        case D_FOREGROUND:
+            want.fg = -1;
+            break;
+        case D_BACKGROUND:
+            want.bg = -1;
+            break;
+        case INVERT_FG_BG:
+            want.invert = true;
+            break;
+        default:
+            want.fg = want.bg = -1;
+            want.invert = false;
+            break;
+    }
+    editorSetRendition(wBuf, want);
+}
+
+// Render the gutters of count lines numbered from first on: "%4d " cut to
+// the panel width. Each number is the previous one counted up in place, so
+// nothing is formatted per line.
+void editorBuildGutters(int first, int count) {
+    SC.gutter = realloc(SC.gutter, (size_t)count * TTE_SIDE_PANEL_WIDTH);
+    char digits[16];
+    int end = sizeof(digits);
+    int start = end;
+    unsigned int n = first;
+    do {
+        digits[--start] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    for (int i = 0; i < count; i++) {
+        char *out = &SC.gutter[i * TTE_SIDE_PANEL_WIDTH];
+        int len = end - start;
+        int pad = TTE_SIDE_PANEL_WIDTH - 1 - len;
+        if (pad < 0) pad = 0;
+        if (len > TTE_SIDE_PANEL_WIDTH - pad) len = TTE_SIDE_PANEL_WIDTH - pad;
+        memset(out, ' ', TTE_SIDE_PANEL_WIDTH);
+        memcpy(out + pad, &digits[start], len);
+
+        int j = end - 1;
+        while (j >= start && digits[j] == '9') digits[j--] = '0';
+        if (j >= start)
+            digits[j]++;
+        else
+            digits[--start] = '1';
+    }
+    SC.gutter_first = first;
+    SC.gutter_count = count;
+}
+
+void editorDrawSidePanel(struct writeBuf *wBuf, const int lineNumber) {
+    int i = lineNumber - SC.gutter_first;
+    if (i < 0 || i >= SC.gutter_count) {
+        editorBuildGutters(lineNumber, EC.screen_rows);
+        i = 0;
+    }
+    editorAppendClrToBuf(wBuf, BACKGROUND, 31, 31, 40);
+    bufAppend(wBuf, &SC.gutter[i * TTE_SIDE_PANEL_WIDTH], TTE_SIDE_PANEL_WIDTH);
+    editorAppendClrToBuf(wBuf, D_BACKGROUND, 0, 0, 0);
+}
+
+// append the part of a UTF-8 render that falls in the visible columns. A wide
+// character cut by the left edge is shown as spaces.
+void editorDrawRenderColumns(struct writeBuf *wBuf, char *render, int rsize) {
+    int col = 0;
+    int idx = 0;
+    int width;
+    while (idx < rsize && col < EC.coloff) {
+        idx += utf8Next(&render[idx], rsize - idx, &width);
+        col += width;
+    }
+    for (int pad = col - EC.coloff; pad > 0; pad--) bufAppend(wBuf, " ", 1);
+    int start = idx;
+    int limit = EC.coloff + EC.screen_cols;
+    while (idx < rsize) {
+        int len = utf8Next(&render[idx], rsize - idx, &width);
+        if (col + width > limit) break;
+        idx += len;
+        col += width;
+    }
+    bufAppend(wBuf, &render[start], idx - start);
+}
+
+// index of the first extra cursor on row cy or below
+int editorCursorFrom(int cy) {
+    int lo = 0;
+    int hi = EC.num_cursors;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (EC.cursors[mid].cy < cy)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void editorDrawRows(struct writeBuf *wBuf) {
+    int screen_line_num;
+    int data_line_num = EC.rowoff;
+    int cursor = editorCursorFrom(EC.rowoff);
+    for (screen_line_num = 0; screen_line_num < EC.screen_rows;
+         screen_line_num++, data_line_num++) {
+        // A line shows its number, the visible part of the row's chars and
+        // the extra cursors drawn over it, so that is what its key covers.
+        uint64_t key = keyMix(data_line_num, EC.coloff);
+        if (data_line_num < EC.data_rows)
+            key = keyMix(key, EC.row[data_line_num].hash);
+        else
+            key = keyMix(key, EC.data_rows == 0 &&
+                                      screen_line_num == EC.screen_rows / 2
+                                  ? 'w'  // the welcome message
+                                  : '~');
+        while (cursor < EC.num_cursors &&
+               EC.cursors[cursor].cy == data_line_num) {
+            key = keyMix(key, EC.cursors[cursor++].cx + 1);
+        }
+        if (!editorScreenLine(wBuf, screen_line_num, key)) continue;
+
+        editorDrawSidePanel(wBuf, data_line_num + 1);
+        if (!EC.wrap_mode) {
+            clearLineRight(wBuf);
+            if (data_line_num >= EC.data_rows) {
+                if (EC.data_rows == 0 &&
+                    screen_line_num == EC.screen_rows / 2) {
+                    printWelcomeMsg(wBuf);
+                } else {
+                    bufAppend(wBuf, "~", 1);
+                }
+            } else {
+                erow *row = &EC.row[data_line_num];
+                char *render = editorRowRender(row);
+                if (row->ascii) {
+                    int len = row->rsize - EC.coloff;
+                    if (len < 0)
+                        len = 0;
+                    else if (len > EC.screen_cols)
+                        len = EC.screen_cols;
+                    bufAppend(wBuf, &render[EC.coloff], len);
+                } else {
+                    editorDrawRenderColumns(wBuf, render, row->rsize);
+                }
+            }
+
+            bufAppend(wBuf, "\r\n", 2);
+        }
+        //		else {
+        //      if (data_line_num > EC.data_rows) continue;
+        //      int size = EC.row[data_line_num].size;
+        //      int loopLen = ceil(size / EC.screen_cols);
+        //      for (int i = 0; i < loopLen; i++) {
+        //          clearLineRight(wBuf);
+
+        //          int startIndex = i * EC.screen_cols;
+        //          int len =
+        //              i != (loopLen - 1) ? EC.screen_cols : size -
+        //              startIndex;
+
+        //          bufAppend(wBuf,
+        //          &EC.row[data_line_num].chars[startIndex], len);
+        //          if (screen_line_num < EC.screen_rows - 1)
+        //              bufAppend(wBuf, "\r\n", 2);
+        //          else
+        //              break;
+        //          if (i != (loopLen - 1)) screen_line_num++;
+        //      }
+        //      data_line_num++;
+        //  }
+    }
+}
+
+// show the extra cursors that are on screen as inverted cells
+void editorDrawExtraCursors(struct writeBuf *wBuf) {
+    for (int i = editorCursorFrom(EC.rowoff); i < EC.num_cursors; i++) {
+        struct cursorPos *cur = &EC.cursors[i];
+        if (cur->cy >= EC.rowoff + EC.screen_rows) break;
+        // lines not sent this frame still show their cursors
+        if (cur->cy >= EC.data_rows || !SC.drawn[cur->cy - EC.rowoff]) continue;
+        erow *row = &EC.row[cur->cy];
+        int col = editorRowCxtoRx(row, cur->cx) - EC.coloff;
+        if (col < 0 || col >= EC.screen_cols) continue;
+
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+                           cur->cy - EC.rowoff + 1,
+                           col + 1 + TTE_SIDE_PANEL_WIDTH);
+        bufAppend(wBuf, buf, len);
+        editorAppendClrToBuf(wBuf, INVERT_FG_BG, 0, 0, 0);
+        if (cur->cx < row->size && row->chars[cur->cx] != '\t') {
+            int width;
+            bufAppend(wBuf, &row->chars[cur->cx],
+                      utf8Next(&row->chars[cur->cx], row->size - cur->cx,
+                               &width));
+        } else {
+            bufAppend(wBuf, " ", 1);
+        }
+        editorAppendClrToBuf(wBuf, RESET, 0, 0, 0);
+    }
+}
+
+void cursorToPosition(struct writeBuf *wBuf) {
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (EC.cy - EC.rowoff) + 1,
+             (EC.rx - EC.coloff) + 1 + TTE_SIDE_PANEL_WIDTH);
+    bufAppend(wBuf, buf, strlen(buf));
+}
+
+void cursorToStatusPos(int x) {
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", EC.screen_cols, x);
+    ttyWrite(buf, strlen(buf));
+}
+
+void editorClearScreen() { ttyWrite("\x1b[2J\x1b[H", 7); }
+
+void hideCursor(struct writeBuf *wBuf) { bufAppend(wBuf, "\x1b[?25l", 6); }
+
+void showCursor(struct writeBuf *wBuf) { bufAppend(wBuf, "\x1b[?25h", 6); }
 
 void editorScroll() {
+    editorLoadRows(EC.rowoff + 2 * EC.screen_rows);  // a page beyond the view
+    EC.rx = 0;
+    if (EC.cy < EC.data_rows) {
+        editorRowThaw(&EC.row[EC.cy]);
+        EC.rx = editorRowCxtoRx(&EC.row[EC.cy], EC.cx);
+    }
+
+    // Update Row offset
+    if (EC.cy < EC.rowoff) {
+        EC.rowoff = EC.cy;
+    }
+    if (EC.cy >= (EC.rowoff + EC.screen_rows)) {
+        EC.rowoff = EC.cy - EC.screen_rows + 1;
+    }
+
+    // Update Coll offset
+    if (EC.rx < EC.coloff) {
+        EC.coloff = EC.rx;
+    }
+
+    if (EC.rx >= (EC.coloff + EC.screen_cols)) {
+        EC.coloff = EC.rx - EC.screen_cols + 1;
+    }
+    // the view and a page either side, as far as one key can move the cursor
+    editorThawRows(EC.rowoff - EC.screen_rows, EC.rowoff + 2 * EC.screen_rows);
+}
+
+void editorRefreshScreen() {
+    PERF_START(frameStart);
+    PERF_START(scrollStart);
+    editorScroll();
+    PERF_END(PERF_SCROLL, scrollStart);
+    struct writeBuf wBuf = WRITEBUF_INIT;
+    if (SC.lines != EC.screen_rows + 2) editorInvalidateScreen();
+    memset(SC.drawn, 0, sizeof(bool) * SC.lines);
+    SC.cursor_line = -1;
+
+    hideCursor(&wBuf);
+
+    PERF_START(drawStart);
+    editorDrawRows(&wBuf);
+    PERF_END(PERF_DRAW, drawStart);
+    struct writeBuf bar = WRITEBUF_INIT;
+    editorDrawStatusBar(&bar);
+    editorPutLine(&wBuf, EC.screen_rows, &bar);
+    editorDrawStatusMsgBar(&bar);
+    editorPutLine(&wBuf, EC.screen_rows + 1, &bar);
+    bufFree(&bar);
+    editorDrawExtraCursors(&wBuf);
+
+    cursorToPosition(&wBuf);
+    showCursor(&wBuf);
+
+    PERF_START(writeStart);
+    ttyWrite(wBuf.pointer, wBuf.len);
+    PERF_END(PERF_WRITE, writeStart);
+    if (PS.enabled) perfRecord(&PS.hist[PERF_BYTES], wBuf.len);
+    bufFree(&wBuf);
+    PERF_END(PERF_FRAME, frameStart);
+}
+
+//== == == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** input ***/
+void editorSetStatusMsg(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(EC.status_msg, sizeof(EC.status_msg), fmt, ap);
+    va_end(ap);
+    EC.status_msg_time = time(NULL);
+}
+
+void editorMoveCursor(int key) {
+    // curRow points to the row(line) of data that the cursor is
+    // currently on.
+    erow *curRow = (EC.cy >= EC.data_rows) ? NULL : &EC.row[EC.cy];
+
+    // Update Curosor Position
+    switch (key) {
+        case ARROW_LEFT:
+            if (EC.cx > 0) {
+                EC.cx = editorRowPrevChar(curRow, EC.cx);
+            } else if (EC.cy > 0) {
+                EC.cy--;
+                EC.cx = EC.row[EC.cy].size;
+            }
+            break;
+        case ARROW_RIGHT:
+            if (curRow && EC.cx < curRow->size) {
+                EC.cx = editorRowNextChar(curRow, EC.cx);
+            } else if (EC.cy < EC.data_rows) {
+                EC.cy++;
+                EC.cx = 0;
+            }
+            break;
+        case ARROW_DOWN:
+            if (EC.cy < EC.data_rows) EC.cy++;
+            break;
+        case ARROW_UP:
+            if (EC.cy > 0) EC.cy--;
+            break;
+        case PAGE_UP: {
+            int newYPos = EC.cy - EC.screen_rows;
+            EC.cy = newYPos >= 0 ? newYPos : 0;
+        } break;
+        case PAGE_DOWN: {
+            int newYPos = EC.cy + EC.screen_rows;
+            EC.cy = newYPos <= EC.data_rows ? newYPos : EC.data_rows;
+        } break;
+        case END:
+            if (curRow) EC.cx = curRow->size;
+            break;
+        case HOME:
+            EC.cx = 0;
+            break;
+    }
+
+    // moving between rows keeps the display column rather than the byte
+    // offset, so the cursor never lands inside a multi-byte character.
+    erow *newRow = (EC.cy >= EC.data_rows) ? NULL : &EC.row[EC.cy];
+    if (newRow && newRow != curRow && key != ARROW_LEFT &&
+        key != ARROW_RIGHT) {
+        int rx = curRow ? editorRowCxtoRx(curRow, EC.cx) : 0;
+        EC.cx = editorRowRxToCx(newRow, rx);
+    }
+
+    // if curosr x position is greater than current rows size then
+    // move it back to the last character. 1 character exception as
+    // it will be needed to type new data.
+    curRow = newRow;
+    int curRowLen = curRow ? curRow->size : 0;
+    if (EC.cx > curRowLen) {
+        EC.cx = curRowLen;
+    }
+
+    // Setting curRow to NULL
+    curRow = NULL;
+}
+
+void editorProcessKeyPress() {
+    static int quit_times = TTE_QUIT_TIMES;
+    int key_read = editorReadKey();
+    PERF_START(keyStart);
+
+    switch (key_read) {
+        case CTRL_KEY('f'):
+            editorFind();
+            break;
+        case CTRL_KEY('s'):
+            editorSave();
+            break;
+        case CTRL_KEY('q'):
+            if (editorAnyDirty() && quit_times > 0) {
+                editorSetStatusMsg(
+                    "WARNING!!! File has unsaved changes. Press "
+                    "CTRL-q %d "
+                    "times to quit.",
+                    quit_times);
+                quit_times--;
+                return;
+            }
+            editorClearScreen();
+            lineCacheJoinWriters();
+            perfDump();
+            logClose();
+            exit(EXIT_SUCCESS);
+            break;
+
+            // Backspace and delete
+            // CTRL + H because it gives out code 8 which was used as
+            // backspace in the olden days
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            if (EC.num_cursors) {
+                editorMultiEdit(
+                    key_read == DEL_KEY ? MULTI_DELETE : MULTI_BACKSPACE, 0);
+                break;
+            }
+            if (key_read == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
+            editorDelChar();
+            break;
+            // Carriage Return
+        case '\r':
+            editorClearCursors();
+            editorInsertNewline();
+            break;
+            // Move Cursor
+        case END:
+        case HOME:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            if (EC.num_cursors) {
+                editorMultiMove(key_read);
+                break;
+            }
+            editorMoveCursor(key_read);
+            break;
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case ARROW_DOWN:
+        case ARROW_UP:
+            editorClearCursors();
+            editorMoveCursor(key_read);
+            break;
+            // Multiple cursors, escape drops the extra ones
+        case CTRL_KEY('d'):
+            editorAddCursorBelow();
+            break;
+        case CTRL_KEY('a'):
+            editorAddCursorsAllRows();
+            break;
+        case CTRL_KEY('e'):
+            editorCommandPrompt();
+            break;
+        case CTRL_KEY('g'):
+            editorGotoPrompt();
+            break;
+        case CTRL_KEY('r'):
+            editorReload();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case '\x1b':
+            editorClearCursors();
+            break;
+            // CTRL + L, redraw the whole screen, for when something
+            // else wrote to the terminal
+        case CTRL_KEY('l'):
+            editorInvalidateScreen();
+            break;
+            // Toggle the frame time overlay
+        case CTRL_KEY('t'):
+            perfToggleOverlay();
+            break;
+            // Buffers
+        case CTRL_KEY('o'):
+            editorOpenBuffer();
+            break;
+        case CTRL_KEY('w'):
+            editorCloseBufferPrompt();
+            break;
+        case CTRL_KEY('n'):
+            editorSwitchBuffer((EB.current + 1) % EB.len);
+            break;
+        case CTRL_KEY('p'):
+            editorSwitchBuffer((EB.current + EB.len - 1) % EB.len);
+            break;
+        case CTRL_KEY('b'):
+            editorMemoryReport();
+            break;
+
+            // Insert Characters
+        default:
+            if (EC.num_cursors) {
+                editorMultiEdit(MULTI_INSERT, key_read);
+                break;
+            }
+            editorInsertChar(key_read);
+            break;
+    }
+    PERF_END(PERF_KEY, keyStart);
+    quit_times = TTE_QUIT_TIMES;
+}
+
+char *editorPromptInput(char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+    size_t buflen = 0;
+    buf[0] = '\0';
+    while (1) {
+        editorSetStatusMsg(prompt, buf);
+        editorRefreshScreen();
+        // cursorToStatusPos(strlen(prompt) + buflen);
+        int c = editorReadKey();
+        if (c == '\x1b') {
+            editorSetStatusMsg("");
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        } else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            while (buflen > 0) {
+                buflen--;
+                if (!utf8IsContinuation(buf[buflen])) break;
+            }
+            buf[buflen] = '\0';
+        } else if (c == '\r') {
+            if (buflen != 0) {
+                editorSetStatusMsg("");
+                if (callback) callback(buf, c);
+                return buf;
+            }
+        } else if (c >= 128 && c < 256) {  // byte of a UTF-8 sequence
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        } else if (!iscntrl(c) && c < 128) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        if (callback) callback(buf, c);
+    }
+}
+
+// editorPromptInput, with reloads of changed files held off until it returns
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    promptDepth++;
+    char *input = editorPromptInput(prompt, callback);
+    promptDepth--;
+    return input;
+}
+//== == == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** batch ***/
+
+// tte -b script [-j workers] file... runs the editing commands in script on
+// each file, without a terminal. One command per line:
+//   open path      edit path instead, a new file if there is none
+//   goto where     move the cursor, see editorGoto
+//   insert text    insert text at the cursor, \n \t and \\ are escapes
+//   delete [n]     delete n lines (1) starting at the cursor line
+//   replace /a/b/  replace every a with b on every line; any delimiter
+//   save [path]    write the buffer to its file, or to path
+// Blank lines and lines starting with # are skipped. Nothing is written
+// without a save. The files are spread over a pool of forked workers, each
+// with an EC of its own.
+
+enum batchOp {
+    BATCH_OPEN,
+    BATCH_GOTO,
+    BATCH_INSERT,
+    BATCH_DELETE,
+    BATCH_REPLACE,
+    BATCH_SAVE
+};
+
+struct batchCommand {
+    enum batchOp op;
+    int line;    // line of the script, for error messages
+    char *text;  // path, position or text with its escapes resolved
+    int len;
+    char *with;  // replacement of text
+    int with_len;
+    long count;    // lines to delete
+    char *source;  // the line text and with point into
+};
+
+struct batchScript {
+    const char *name;
+    struct batchCommand *cmds;
+    int len;
+    int cap;
+    int lines;  // lines parsed so far
+    bool failed;
+};
+
+// Resolve the escapes of the text at s, in place, up to the first delim that
+// is not escaped. Returns what follows that delim, or NULL if the text ended
+// first.
+char *batchUnescape(char *s, char delim, int *len) {
+    char *in = s;
+    char *out = s;
+    while (*in && *in != delim) {
+        char c = *in++;
+        if (c == '\\' && *in) {
+            c = *in++;
+            if (c == 'n') c = '\n';
+            if (c == 't') c = '\t';
+        }
+        *out++ = c;
+    }
+    char *rest = *in ? in + 1 : NULL;
+    *out = '\0';
+    *len = out - s;
+    return rest;
+}
+
+// parse one line of the script into a command; the line is kept for good
+const char *batchParseCommand(struct batchCommand *cmd, char *line) {
+    char *args;
+    if ((args = editorCommandArgs(line, "open"))) {
+        cmd->op = BATCH_OPEN;
+        cmd->text = args;
+        if (*args == '\0') return "open needs a path";
+    } else if ((args = editorCommandArgs(line, "goto"))) {
+        cmd->op = BATCH_GOTO;
+        cmd->text = args;
+        if (*args == '\0') return "goto needs a line, N% or @offset";
+    } else if (editorCommandArgs(line, "insert")) {
+        // everything after the one space is text, leading spaces included
+        cmd->op = BATCH_INSERT;
+        cmd->text = line[6] ? line + 7 : line + 6;
+        batchUnescape(cmd->text, '\0', &cmd->len);
+    } else if ((args = editorCommandArgs(line, "delete"))) {
+        cmd->op = BATCH_DELETE;
+        cmd->count = 1;
+        if (*args) {
+            char *end;
+            cmd->count = strtol(args, &end, 10);
+            if (*end != '\0' || cmd->count < 1) return "delete takes a count";
+        }
+    } else if ((args = editorCommandArgs(line, "replace"))) {
+        cmd->op = BATCH_REPLACE;
+        char delim = *args;
+        if (delim == '\0') return "replace needs /text/replacement/";
+        cmd->text = args + 1;
+        cmd->with = batchUnescape(cmd->text, delim, &cmd->len);
+        if (cmd->with == NULL) return "replace needs /text/replacement/";
+        char *rest = batchUnescape(cmd->with, delim, &cmd->with_len);
+        if (rest && *rest) return "text after the replacement";
+        if (cmd->len == 0) return "nothing to replace";
+        if (memchr(cmd->text, '\n', cmd->len) ||
+            memchr(cmd->with, '\n', cmd->with_len))
+            return "replace works within lines";
+    } else if ((args = editorCommandArgs(line, "save"))) {
+        cmd->op = BATCH_SAVE;
+        cmd->text = *args ? args : NULL;
+    } else {
+        return "unknown command";
+    }
+    return NULL;
+}
+
+// readLines callback adding a line of the script
+void batchParseLine(void *ctx, long long offset, char *line, int linelen) {
+    (void)offset;
+    struct batchScript *script = ctx;
+    script->lines++;
+    char *text = strndup(line, lineContentLength(line, linelen));
+    char *start = text;
+    while (*start == ' ' || *start == '\t') start++;
+    if (*start == '\0' || *start == '#') {
+        free(text);
+        return;
+    }
+
+    struct batchCommand cmd = {0};
+    cmd.line = script->lines;
+    cmd.source = text;
+    const char *error = batchParseCommand(&cmd, start);
+    if (error) {
+        fprintf(stderr, "%s:%d: %s\n", script->name, cmd.line, error);
+        script->failed = true;
+        free(text);
+        return;
+    }
+    if (script->len == script->cap) {
+        script->cap = script->cap ? script->cap * 2 : 16;
+        script->cmds =
+            realloc(script->cmds, script->cap * sizeof(struct batchCommand));
+        if (script->cmds == NULL) die("realloc");
+    }
+    script->cmds[script->len++] = cmd;
+}
+
+void batchFreeScript(struct batchScript *script) {
+    for (int i = 0; i < script->len; i++) free(script->cmds[i].source);
+    free(script->cmds);
+}
+
+bool batchFail(struct batchScript *script, struct batchCommand *cmd,
+               const char *error) {
+    fprintf(stderr, "%s: %s:%d: %s\n", EC.filename ? EC.filename : "(new)",
+            script->name, cmd->line, error);
+    return false;
+}
+
+// replace every cmd->text in the buffer by cmd->with
+void batchReplace(struct batchCommand *cmd) {
+    struct writeBuf out = WRITEBUF_INIT;
+    for (int i = 0; i < EC.data_rows; i++) {
+        erow *row = &EC.row[i];
+        const char *from = editorRowChars(row);
+        const char *end = from + row->size;
+        const char *hit = memmem(from, row->size, cmd->text, cmd->len);
+        if (hit == NULL) continue;
+        out.len = 0;
+        while (hit) {
+            bufAppend(&out, from, hit - from);
+            bufAppend(&out, cmd->with, cmd->with_len);
+            from = hit + cmd->len;
+            hit = memmem(from, end - from, cmd->text, cmd->len);
+        }
+        bufAppend(&out, from, end - from);
+        editorRowThaw(row);
+        editorRowSetString(row, out.pointer, out.len);
+    }
+    bufFree(&out);
+    editorClampCursor();
+}
+
+bool batchSave(struct batchScript *script, struct batchCommand *cmd) {
+    char *path = cmd->text ? cmd->text : EC.filename;
+    if (path == NULL) return batchFail(script, cmd, "save needs a path");
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    int len = fd == -1 ? -1 : editorWriteRows(fd);
+    if (len == -1) {
+        int error = errno;
+        if (fd != -1) close(fd);
+        return batchFail(script, cmd, strerror(error));
+    }
+    editorStampFile(fd);
+    close(fd);
+    if (path != EC.filename) {
+        free(EC.filename);
+        EC.filename = strdup(path);
+    }
+    return true;
+}
+
+// run cmd on the current buffer; if it cannot be done say why and return false
+bool batchRunCommand(struct batchScript *script, struct batchCommand *cmd) {
+    switch (cmd->op) {
+        case BATCH_OPEN:
+            editorFreeBuffer();
+            if (fileExists(cmd->text)) {
+                if (access(cmd->text, R_OK) != 0)
+                    return batchFail(script, cmd, strerror(errno));
+                editorOpen(cmd->text);
+            } else {
+                EC.filename = strdup(cmd->text);
+            }
+            return true;
+        case BATCH_GOTO:
+            if (!editorGoto(cmd->text))
+                return batchFail(script, cmd, "not a line, N% or @offset");
+            return true;
+        case BATCH_INSERT:
+            for (int i = 0; i < cmd->len; i++) {
+                if (cmd->text[i] == '\n') {
+                    editorInsertNewline();
+                } else {
+                    editorInsertChar(cmd->text[i]);
+                }
+            }
+            return true;
+        case BATCH_DELETE: {
+            editorLoadAll();
+            long count = EC.data_rows - EC.cy;
+            if (cmd->count < count) count = cmd->count;
+            editorReplaceRows(EC.cy, count, NULL, 0, NULL);
+            EC.cx = 0;
+            return true;
+        }
+        case BATCH_REPLACE:
+            editorLoadAll();
+            batchReplace(cmd);
+            return true;
+        case BATCH_SAVE:
+            editorLoadAll();
+            return batchSave(script, cmd);
+    }
+    return false;
+}
+
+// run the whole script on the file at path, or on an empty buffer if path is
+// NULL. Returns false if a command failed.
+bool batchRunScript(struct batchScript *script, char *path) {
+    editorFreeBuffer();
+    if (path) {
+        if (access(path, R_OK) != 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return false;
+        }
+        editorOpen(path);
+    }
+    for (int i = 0; i < script->len; i++) {
+        if (!batchRunCommand(script, &script->cmds[i])) return false;
+    }
+    return true;
+}
+
+// Run the script on the files whose indexes are read from the jobs pipe
+// until it is closed, or on all of them in order if jobs is -1. Returns the
+// number of files the whole script ran on.
+int batchWorker(struct batchScript *script, char **files, int count,
+                int jobs) {
+    int done = 0;
+    int next = 0;
+    int index;
+    // every index is written on its own, so it is read in one piece
+    while (jobs == -1 ? (index = next++) < count
+                      : read(jobs, &index, sizeof(index)) == sizeof(index)) {
+        done += batchRunScript(script, files[index]);
+    }
+    editorFreeBuffer();
+    return done;
+}
+
+// Fork workers and hand them the files one index at a time, so a few large
+// files do not hold up the rest. Returns the number of files done.
+int batchPool(struct batchScript *script, char **files, int count,
+              int workers) {
+    int jobs[2];
+    int results[2];
+    if (pipe(jobs) == -1 || pipe(results) == -1) die("pipe");
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid == -1) break;
+        if (pid == 0) {
+            close(jobs[1]);
+            close(results[0]);
+            int done = batchWorker(script, files, count, jobs[0]);
+            _exit(write(results[1], &done, sizeof(done)) == sizeof(done)
+                      ? EXIT_SUCCESS
+                      : EXIT_FAILURE);
+        }
+        started++;
+    }
+    close(jobs[0]);
+    close(results[1]);
+    if (started == 0) {
+        close(jobs[1]);
+        close(results[0]);
+        return batchWorker(script, files, count, -1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (write(jobs[1], &i, sizeof(i)) != sizeof(i)) break;
+    }
+    close(jobs[1]);
+    int done = 0;
+    int n;
+    while (read(results[0], &n, sizeof(n)) == sizeof(n)) done += n;
+    close(results[0]);
+    while (wait(NULL) > 0) {
+    }
+    return done;
+}
+
+int batchMain(int argc, char *argv[]) {
+    batchMode = true;
+    lineCacheEnabled = false;  // one pass over many files, no side files
+    signal(SIGPIPE, SIG_IGN);  // a worker that died must not take us along
+    editorInitBuffer();
+
+    struct batchScript script = {0};
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "b:j:")) != -1) {
+        switch (opt) {
+            case 'b':
+                script.name = optarg;
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: tte -b script [-j workers] [file...]\n");
+                return EXIT_FAILURE;
+        }
+    }
+    int fd = strcmp(script.name, "-") == 0 ? STDIN_FILENO
+                                           : open(script.name, O_RDONLY);
+    if (fd == -1 || readLines(fd, batchParseLine, &script) == -1) {
+        fprintf(stderr, "%s: %s\n", script.name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    char **files = argv + optind;
+    int count = argc - optind;
+    if (script.failed || count == 0) {
+        // without files the script opens what it edits
+        bool ok = !script.failed && batchRunScript(&script, NULL);
+        editorFreeBuffer();
+        batchFreeScript(&script);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (workers > count) workers = count;
+    if (workers < 1) workers = 1;
+
+    long long start = monotonicNs();
+    int done = workers == 1 ? batchWorker(&script, files, count, -1)
+                            : batchPool(&script, files, count, workers);
+    double seconds = (monotonicNs() - start) / 1e9;
+    fprintf(stderr, "%d files in %.3f s, %.0f files/s, %ld workers\n", count,
+            seconds, seconds > 0 ? count / seconds : 0, workers);
+    if (done < count) fprintf(stderr, "%d files failed\n", count - done);
+    batchFreeScript(&script);
+    return done == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//== == == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** init ***/
+
+// reset the per buffer part of EC to an empty buffer
+void editorInitBuffer() {
+    EC.cx = 0;
+    EC.cy = 0;
     EC.rx = 0;
-    if (EC.cy < EC.data_rows) {
-        EC.rx = editorRowCxtoRx(&EC.row[EC.cy], EC.cx);
+    EC.ry = 0;
+    EC.rowoff = 0;
+    EC.coloff = 0;
+    EC.data_rows = 0;
+    EC.rows_cap = 0;
+    EC.row = NULL;
+    EC.dirty = false;
+    EC.max_data_cols = EC.screen_cols;
+    EC.filename = NULL;
+    memset(&EC.text, 0, sizeof(EC.text));
+    memset(&EC.render, 0, sizeof(EC.render));
+    EC.render_epoch = 0;
+    EC.cursors = NULL;
+    EC.num_cursors = 0;
+    EC.cursors_cap = 0;
+    memset(&EC.disk, 0, sizeof(EC.disk));
+    EC.watch = -1;
+    EC.disk_check = false;
+    EC.disk_changed = false;
+    EC.reload = NULL;
+    memset(&EC.saved, 0, sizeof(EC.saved));
+    EC.rows_differ = 0;
+    EC.rows_moved = false;
+    EC.crlf = false;
+    EC.load_fd = -1;
+    EC.load_next = 0;
+    EC.cold = NULL;
+    EC.cold_bytes = 0;
+    EC.warm_rows = 0;
+    EC.warm_mark = TTE_COLD_SLACK;  // small buffers are not worth freezing
+    EC.freeze_next = 0;
+    memset(&EC.offsets, 0, sizeof(EC.offsets));
+    memset(&EC.undo, 0, sizeof(EC.undo));
+}
+
+void initEditor() {
+    EC.wrap_mode = false;
+    if (getWindowSize(&EC.screen_rows, &EC.screen_cols) == -1) {
+        die("getWindowSize");
     }
+    EC.screen_cols -= TTE_SIDE_PANEL_WIDTH;
+    EC.screen_rows -= 2;
+    EC.status_msg[0] = '\0';
+    EC.status_msg_time = 0;
+    editorInitBuffer();
+    EB.len = 1;
+    EB.current = 0;
+}
 
-    // Update Row offset
-    if (EC.cy < EC.rowoff) {
-        EC.rowoff = EC.cy;
+#if !defined(TTE_BENCH) && !defined(TTE_FUZZ)
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+        return batchMain(argc, argv);
     }
-    if (EC.cy >= (EC.rowoff + EC.screen_rows)) {
-        EC.rowoff = EC.cy - EC.screen_rows + 1;
+    char *record = getenv("TTE_RECORD");
+    if (record) ttyRecordFd = open(record, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    PS.enabled = getenv("TTE_PERF") != NULL;
+    if (getenv("TTE_LOG_FLUSH")) logStartFlusher();
+    if (getenv("TTE_NO_CACHE")) lineCacheEnabled = false;
+    if (getenv("TTE_COMPRESS")) coldRowsEnabled = true;
+    enableRawMode();
+    initEditor();
+    if (argc >= 2) {
+        editorOpen(argv[1]);
     }
+    editorSetStatusMsg("HELP: CTRL-s to save | CTRL-q to quit");
+    if (argc >= 3 && !editorGoto(argv[2])) {
+        editorSetStatusMsg("not a line, N%% or @offset: %s", argv[2]);
+    }
+    while (true) {
+        editorRefreshScreen();
+        editorProcessKeyPress();
+    }
+    return 0;
+}
+#endif
 
-    // Update Coll offset
-    if (EC.rx < EC.coloff) {
-        EC.coloff = EC.rx;
+//== == == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** headless benchmark ***/
+#ifdef TTE_BENCH
+
+#define BENCH_KEY_PAGE_UP "\x1b[5~"
+#define BENCH_KEY_PAGE_DOWN "\x1b[6~"
+#define BENCH_KEY_ARROW_UP "\x1b[A"
+#define BENCH_KEY_ARROW_DOWN "\x1b[B"
+
+// cheap deterministic pseudo random numbers so every run sees the same corpus
+unsigned int benchRandState = 12345;
+unsigned int benchRand() {
+    benchRandState = benchRandState * 1103515245 + 12345;
+    return (benchRandState >> 16) & 0x7fff;
+}
+
+void benchAppendStr(struct writeBuf *wBuf, const char *s) {
+    bufAppend(wBuf, s, strlen(s));
+}
+
+void benchAppendRepeat(struct writeBuf *wBuf, const char *s, int times) {
+    while (times--) benchAppendStr(wBuf, s);
+}
+
+// when set the corpus mixes scripts instead of being plain ASCII
+bool benchUtf8 = false;
+
+// write a generated corpus of log like lines, with an indented tabbed line
+// every so often, to path.
+void benchWriteCorpus(const char *path, int lines) {
+    static const char *levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    static const char *ascii[] = {"request", "worker", "cache", "flush",
+                                  "socket", "buffer", "commit", "replay"};
+    static const char *mixed[] = {"запрос", "作業者", "cache", "café",
+                                  "ソケット", "버퍼", "commit", "🚀replay"};
+    const char **words = benchUtf8 ? mixed : ascii;
+    FILE *fp = fopen(path, "w");
+    if (!fp) die("benchWriteCorpus");
+    for (int i = 0; i < lines; i++) {
+        if (i % 16 == 15) {
+            fprintf(fp, "\t\t%s = %s(%d);\n", words[benchRand() % 8],
+                    words[benchRand() % 8], i);
+            continue;
+        }
+        fprintf(fp, "2026-10-18 12:%02d:%02d %-5s %s-%d %s id=%d took %dms\n",
+                (i / 60) % 60, i % 60, levels[benchRand() % 4],
+                words[benchRand() % 8], benchRand() % 32,
+                words[benchRand() % 8], i, benchRand() % 1000);
     }
+    fclose(fp);
+}
 
-    if (EC.rx >= (EC.coloff + EC.screen_cols)) {
-        EC.coloff = EC.rx - EC.screen_cols + 1;
+// typing: a few sentences typed in the middle of the file, with newlines and
+// corrections.
+void benchScriptTyping(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    benchAppendRepeat(keys, BENCH_KEY_PAGE_DOWN, 20);
+    const char *sentence = benchUtf8 ? "the quick brown 狐 jumps över the dog"
+                                     : "the quick brown fox jumps over the dog";
+    for (int i = 0; i < 40; i++) {
+        benchAppendStr(keys, sentence);
+        benchAppendRepeat(keys, "\x7f", 4);
+        benchAppendStr(keys, "\r");
     }
 }
 
-void editorRefreshScreen() {
-    editorScroll();
-    struct writeBuf wBuf = WRITEBUF_INIT;
+// paste: a large burst of input arriving at once, as a terminal delivers it.
+void benchScriptPaste(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    for (int i = 0; i < 500; i++) {
+        benchAppendStr(keys, "\tpasted line of text with some words in it;\r");
+    }
+}
+
+// search: incremental search typed character by character, then stepping
+// forwards and backwards through the matches.
+void benchScriptSearch(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    benchAppendStr(keys, "\x06" "cache-1");
+    benchAppendRepeat(keys, BENCH_KEY_ARROW_DOWN, 50);
+    benchAppendRepeat(keys, BENCH_KEY_ARROW_UP, 20);
+    benchAppendStr(keys, "\r");
+}
+
+// scroll: paging down and back up the file, then walking line by line.
+void benchScriptScroll(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    benchAppendRepeat(keys, BENCH_KEY_PAGE_DOWN, 300);
+    benchAppendRepeat(keys, BENCH_KEY_PAGE_UP, 300);
+    benchAppendRepeat(keys, BENCH_KEY_ARROW_DOWN, 300);
+}
+
+// save: a small edit followed by saving and confirming the overwrite.
+void benchScriptSave(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    benchAppendStr(keys, "edit\r");
+    for (int i = 0; i < 3; i++) benchAppendStr(keys, "\x13y\r");
+}
+
+// buffers: open the corpus in two more buffers and cycle between them.
+void benchScriptBuffers(struct writeBuf *keys, const char *corpus) {
+    for (int i = 0; i < 2; i++) {
+        benchAppendStr(keys, "\x0f");
+        benchAppendStr(keys, corpus);
+        benchAppendStr(keys, "\r" BENCH_KEY_PAGE_DOWN);
+    }
+    benchAppendRepeat(keys, "\x0e", 150);
+    benchAppendRepeat(keys, "\x10", 150);
+}
+
+// cursors: a column edit with a cursor on every row of the file.
+void benchScriptCursors(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    benchAppendStr(keys, "\x01" "abc\x7f\x7f" "\x1b[F" ",x\x1b[D\x1b[3~");
+    benchAppendStr(keys, "\x1b[H" "#\x1b[C\x1b[C");
+}
+
+// filter: pipe part of the file and then all of it through commands.
+void benchScriptFilter(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    benchAppendStr(keys, "\x05" "1,5000!rev\r");
+    benchAppendStr(keys, "\x05" "%!sort\r");
+}
+
+// sort: the built-in sort, uniq and grep over the whole file.
+void benchScriptSort(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    benchAppendStr(keys, "\x05" "sort\r");
+    benchAppendStr(keys, "\x05" "uniq\r");
+    benchAppendStr(keys, "\x05" "grep -v 7\r");
+}
+
+// goto: jumps by percentage, byte offset and line number, with a line split
+// every few jumps so the byte index has to be rebuilt.
+void benchScriptGoto(struct writeBuf *keys, const char *corpus) {
+    (void)corpus;
+    char cmd[64];
+    for (int i = 0; i < 40; i++) {
+        snprintf(cmd, sizeof(cmd), "\x07%d%%\r", (i * 37) % 100);
+        benchAppendStr(keys, cmd);
+        snprintf(cmd, sizeof(cmd), "\x07@%d\r", i * 250007);
+        benchAppendStr(keys, cmd);
+        snprintf(cmd, sizeof(cmd), "\x07%d\r", i * 4999 + 1);
+        benchAppendStr(keys, cmd);
+        if (i % 10 == 9) benchAppendStr(keys, "x\r");
+    }
+}
+
+int benchCompareLL(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// value at quantile q of the sorted latency samples, in microseconds
+double benchPercentile(double q) {
+    if (BT.lat_len == 0) return 0;
+    return BT.lat[(int)(q * (BT.lat_len - 1))] / 1000.0;
+}
+
+// release everything the editor holds so the next scenario starts fresh
+void benchResetEditor() {
+    while (EB.len > 1) editorCloseBuffer();
+    editorFreeBuffer();
+}
+
+void benchRun(const char *name, const char *corpus, const char *savePath,
+              const char *keys, int keysLen) {
+    benchResetEditor();
+    long long start = monotonicNs();
+    editorOpen((char *)corpus);
+    long long openNs = monotonicNs() - start;
+    editorFreezeRows();  // what the editor does once it waits for keys
+    size_t heap = EC.text.reserved + EC.render.reserved +
+                  sizeof(erow) * EC.rows_cap + EC.cold_bytes + CC.bytes;
+    // a lazy open has not read every line yet but sized its row array
+    int lines = EC.saved.lines > EC.data_rows ? EC.saved.lines : EC.data_rows;
+    double heapPerLine = lines ? (double)heap / lines : 0;
+    if (savePath) {
+        free(EC.filename);
+        EC.filename = strdup(savePath);
+    }
+
+    BT.keys = keys;
+    BT.keys_len = keysLen;
+    BT.keys_pos = 0;
+    BT.lat_len = 0;
+    BT.frames = 0;
+    BT.out_bytes = 0;
+    BT.max_frame_bytes = 0;
+    BT.last_key = monotonicNs();
+    while (BT.keys_pos < BT.keys_len) {
+        editorRefreshScreen();
+        editorProcessKeyPress();
+    }
+    editorRefreshScreen();
+    benchMarkKey();
+    BT.last_key = 0;
+
+    qsort(BT.lat, BT.lat_len, sizeof(long long), benchCompareLL);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-8s %8.1f %8.1f %7d %9.1f %9.1f %9.1f %9.1f %9lld %9d %9ld\n",
+           name, openNs / 1e6, heapPerLine, BT.lat_len, benchPercentile(0.5),
+           benchPercentile(0.9), benchPercentile(0.99), benchPercentile(1.0),
+           BT.frames ? BT.out_bytes / BT.frames : 0, BT.max_frame_bytes,
+           usage.ru_maxrss);
+}
+
+// Run a scenario in a child process, so the peak RSS it reports is its own
+// and not that of the scenarios before it. The parent never opens the corpus.
+void benchRunForked(const char *name, const char *corpus, const char *savePath,
+                    const char *keys, int keysLen) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+        benchRun(name, corpus, savePath, keys, keysLen);
+        lineCacheJoinWriters();  // the next scenario may open from the cache
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        printf("%-8s failed\n", name);
+    }
+}
+
+// read a recorded keystroke file (see TTE_RECORD) into keys
+void benchLoadKeys(const char *path, struct writeBuf *keys) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) die("benchLoadKeys");
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) bufAppend(keys, buf, n);
+    fclose(fp);
+}
+
+void benchUsage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-p] [-u] [-l] [-z] [-r rows] [-c cols] [-n lines] "
+            "[-s scenario] [-k keyfile] [file]\n"
+            "scenarios: typing paste search scroll save buffers cursors "
+            "filter sort goto\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct {
+        const char *name;
+        void (*script)(struct writeBuf *, const char *);
+    } scenarios[] = {
+        {"typing", benchScriptTyping}, {"paste", benchScriptPaste},
+        {"search", benchScriptSearch}, {"scroll", benchScriptScroll},
+        {"save", benchScriptSave},     {"buffers", benchScriptBuffers},
+        {"cursors", benchScriptCursors}, {"filter", benchScriptFilter},
+        {"sort", benchScriptSort},       {"goto", benchScriptGoto},
+    };
+    int numScenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+
+    BT.rows = 50;
+    BT.cols = 160;
+    int lines = 200000;
+    const char *only = NULL;
+    const char *keyFile = NULL;
+    int opt;
+    lineCacheEnabled = false;
+    while ((opt = getopt(argc, argv, "pulzr:c:n:s:k:")) != -1) {
+        switch (opt) {
+            case 'l':
+                lineCacheEnabled = true;  // reopen from the line cache
+                break;
+            case 'z':
+                coldRowsEnabled = true;  // freeze rows away from the view
+                break;
+            case 'p':
+                PS.enabled = true;  // measure with instrumentation on
+                break;
+            case 'u':
+                benchUtf8 = true;  // mixed-script corpus
+                break;
+            case 'r':
+                BT.rows = atoi(optarg);
+                break;
+            case 'c':
+                BT.cols = atoi(optarg);
+                break;
+            case 'n':
+                lines = atoi(optarg);
+                break;
+            case 's':
+                only = optarg;
+                break;
+            case 'k':
+                keyFile = optarg;
+                break;
+            default:
+                benchUsage(argv[0]);
+        }
+    }
+    if (BT.rows < 3 || BT.cols <= TTE_SIDE_PANEL_WIDTH) benchUsage(argv[0]);
+
+    char corpusPath[] = "/tmp/tte-bench-corpus-XXXXXX";
+    char savePath[] = "/tmp/tte-bench-save-XXXXXX";
+    const char *corpus = optind < argc ? argv[optind] : NULL;
+    if (!corpus) {
+        int fd = mkstemp(corpusPath);
+        if (fd == -1) die("mkstemp");
+        close(fd);
+        benchWriteCorpus(corpusPath, lines);
+        corpus = corpusPath;
+    }
+    int saveFd = mkstemp(savePath);
+    if (saveFd == -1) die("mkstemp");
+    close(saveFd);
+
+    initEditor();
+    printf("terminal %dx%d, corpus %s\n", BT.cols, BT.rows, corpus);
+    printf("%-8s %8s %8s %7s %9s %9s %9s %9s %9s %9s %9s\n", "scenario",
+           "open(ms)", "heap/ln", "keys", "p50(us)", "p90(us)", "p99(us)", "max(us)",
+           "B/frame", "maxB/frm", "rss(KB)");
+    for (int i = 0; i < numScenarios; i++) {
+        if (keyFile || (only && strcmp(only, scenarios[i].name) != 0))
+            continue;
+        struct writeBuf keys = WRITEBUF_INIT;
+        scenarios[i].script(&keys, corpus);
+        benchRunForked(scenarios[i].name, corpus,
+                       strcmp(scenarios[i].name, "save") == 0 ? savePath
+                                                              : NULL,
+                       keys.pointer, keys.len);
+        bufFree(&keys);
+    }
+    if (keyFile) {
+        struct writeBuf keys = WRITEBUF_INIT;
+        benchLoadKeys(keyFile, &keys);
+        benchRunForked("replay", corpus, savePath, keys.pointer, keys.len);
+        bufFree(&keys);
+    }
+
+    lineCacheJoinWriters();
+    if (lineCacheEnabled && corpus == corpusPath) {
+        char *cachePath = lineCachePath(corpusPath, false);
+        if (cachePath) unlink(cachePath);
+        free(cachePath);
+    }
+    if (corpus == corpusPath) unlink(corpusPath);
+    unlink(savePath);
+    free(BT.lat);
+    return 0;
+}
+#endif
+
+//== == == == == == == == == == == == == == == == == == == == == ==
+//== == ==
+/*** row engine fuzzing ***/
+#ifdef TTE_FUZZ
+
+// Random edits are applied both to the rows of EC and to a model that keeps
+// the lines as plain strings, and after every step the two must agree on the
+// text and the cursor. Row hashes, byte offsets and the dirty flag are
+// checked against the model too, and every so often the buffer is saved and
+// the file compared. Rows are frozen and the text arena compacted as the
+// idle editor would, and filters and sorts are undone. The pass runs on a
+// file with "\n" line endings and again on one with "\r\n". A second pass
+// times every kind of edit on a larger buffer; with -B the times are
+// compared to a baseline file and the run fails if one got slower by more
+// than the threshold.
+
+enum fuzzOp {
+    FUZZ_INSERT_CHAR,  // editor operations, at the cursor
+    FUZZ_INSERT_NEWLINE,
+    FUZZ_DEL_CHAR,
+    FUZZ_ROW_INSERT_CHAR,  // row operations, on a random row
+    FUZZ_ROW_DEL_CHAR,
+    FUZZ_ROW_DEL_RANGE,
+    FUZZ_ROW_APPEND,
+    FUZZ_ROW_SET,
+    FUZZ_INSERT_ROW,  // operations on the row array
+    FUZZ_DEL_ROW,
+    FUZZ_REPLACE_ROWS,
+    FUZZ_MOVE,  // put the cursor somewhere else
+    FUZZ_TIMED,  // the kinds before are also timed, the rest only checked
+    FUZZ_FILTER_LINES = FUZZ_TIMED,  // grep or uniq on a few rows
+    FUZZ_UNDO,
+    FUZZ_FREEZE,  // freeze rows and compact the text arena
+    FUZZ_THAW,
+    FUZZ_SORT,
+    FUZZ_OPS
+};
+
+// with the calibration time of the timings after them
+const char *fuzzOpNames[FUZZ_OPS + 1] = {
+    "insert-char",  "insert-newline", "del-char",     "row-insert-char",
+    "row-del-char", "row-del-range",  "row-append",   "row-set",
+    "insert-row",   "del-row",        "replace-rows", "move",
+    "filter-lines", "undo",           "freeze",       "thaw",
+    "sort",         "calibration",
+};
+
+struct fuzzModel {
+    struct writeBuf *lines;
+    int len;
+    int cap;
+    int cx;
+    int cy;
+    int eol;                // bytes of the line ending, 1 or 2 for "\r\n"
+    struct writeBuf saved;  // the file as last saved
+    struct writeBuf before;  // the text before the last undoable step
+    struct writeBuf after;   // and right after it
+    int undo_cx;
+    int undo_cy;
+};
+
+uint64_t fuzzState = 1;
+long fuzzSteps = 0;  // steps done by the property pass
+char fuzzLast[160];  // the last step, for the failure report
+
+// xorshift64*, so a seed always gives the same run
+unsigned int fuzzRand() {
+    fuzzState ^= fuzzState >> 12;
+    fuzzState ^= fuzzState << 25;
+    fuzzState ^= fuzzState >> 27;
+    return (fuzzState * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// a byte of inserted text: mostly ASCII, with tabs and pieces of UTF-8 that
+// do not always make up whole characters
+char fuzzByte() {
+    static const char bytes[] = "abcdefghijklmnopqrstuvwxyz    \t\t"
+                                "\xc3\xa9\xe4\xbd\x9c\x80";
+    return bytes[fuzzRand() % (sizeof(bytes) - 1)];
+}
+
+int fuzzText(char *buf, int max) {
+    int len = fuzzRand() % (max + 1);
+    for (int i = 0; i < len; i++) buf[i] = fuzzByte();
+    return len;
+}
+
+// an offset into something of size bytes, often on or just past either end
+int fuzzOffset(int size) {
+    switch (fuzzRand() % 8) {
+        case 0:
+            return -1;
+        case 1:
+            return 0;
+        case 2:
+            return size;
+        case 3:
+            return size + 1;
+        case 4:
+            return size - 1;
+        default:
+            return fuzzRand() % (size + 1);
+    }
+}
+
+void fuzzNote(struct fuzzModel *m, const char *fmt, ...) {
+    if (m == NULL) return;  // timing, nobody reads it
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(fuzzLast, sizeof(fuzzLast), fmt, ap);
+    va_end(ap);
+}
+
+void fuzzFail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "step %ld, after %s: ", fuzzSteps, fuzzLast);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+// The model. Every operation is done the obvious way, copying the line.
+
+// replace del bytes at at in line with len bytes of s
+void fuzzSplice(struct writeBuf *line, int at, int del, const char *s,
+                int len) {
+    char *next = malloc(line->len - del + len + 1);
+    memcpy(next, line->pointer, at);
+    memcpy(next + at, s, len);
+    memcpy(next + at + len, line->pointer + at + del, line->len - at - del);
+    free(line->pointer);
+    line->pointer = next;
+    line->len += len - del;
+    line->cap = line->len + 1;
+}
+
+void fuzzModelInsert(struct fuzzModel *m, int at, const char *s, int len) {
+    if (m->len == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 64;
+        m->lines = realloc(m->lines, m->cap * sizeof(struct writeBuf));
+    }
+    memmove(&m->lines[at + 1], &m->lines[at],
+            (m->len - at) * sizeof(struct writeBuf));
+    struct writeBuf line = {malloc(len + 1), len, len + 1};
+    memcpy(line.pointer, s, len);
+    m->lines[at] = line;
+    m->len++;
+}
+
+void fuzzModelDelete(struct fuzzModel *m, int at) {
+    free(m->lines[at].pointer);
+    memmove(&m->lines[at], &m->lines[at + 1],
+            (m->len - at - 1) * sizeof(struct writeBuf));
+    m->len--;
+}
+
+// delete len bytes at at of line, or as many as there are; outside the line
+// nothing happens
+void fuzzModelDelRange(struct writeBuf *line, int at, int len) {
+    if (at < 0 || at >= line->len || len <= 0) return;
+    if (len > line->len - at) len = line->len - at;
+    fuzzSplice(line, at, len, "", 0);
+}
+
+void fuzzModelClamp(struct fuzzModel *m) {
+    if (m->cy > m->len) m->cy = m->len;
+    int lineLen = m->cy < m->len ? m->lines[m->cy].len : 0;
+    if (m->cx > lineLen) m->cx = lineLen;
+}
 
-    hideCursor(&wBuf);
-    cursorToHome(&wBuf);
+// the model's lines as the file they would be saved to
+void fuzzModelText(struct fuzzModel *m, struct writeBuf *out) {
+    out->len = 0;
+    for (int i = 0; i < m->len; i++) {
+        bufAppend(out, m->lines[i].pointer, m->lines[i].len);
+        if (m->eol == 2) bufAppend(out, "\r", 1);
+        bufAppend(out, "\n", 1);
+    }
+}
 
-    editorDrawRows(&wBuf);
-    editorDrawStatusBar(&wBuf);
-    editorDrawStatusMsgBar(&wBuf);
+// replace the model's lines with those of text
+void fuzzModelSetText(struct fuzzModel *m, struct writeBuf *text) {
+    while (m->len) fuzzModelDelete(m, m->len - 1);
+    for (int at = 0; at < text->len;) {
+        char *end = memchr(text->pointer + at, '\n', text->len - at);
+        fuzzModelInsert(m, m->len, text->pointer + at,
+                        end - (text->pointer + at) - (m->eol - 1));
+        at = end - text->pointer + 1;
+    }
+}
 
-    cursorToPosition(&wBuf);
-    showCursor(&wBuf);
+// drop lines first..last that the editor's grep (or uniq, without pattern)
+// drops. If any are, the text before and after is kept for an undo.
+void fuzzModelFilter(struct fuzzModel *m, int first, int last,
+                     const char *pattern, int len, bool invert) {
+    bool *keep = malloc(last - first + 1);
+    bool removed = false;
+    for (int i = first; i <= last; i++) {
+        struct writeBuf *line = &m->lines[i];
+        if (pattern) {
+            keep[i - first] =
+                (memmem(line->pointer, line->len, pattern, len) != NULL) !=
+                invert;
+        } else {
+            struct writeBuf *prev = &m->lines[i - 1];
+            keep[i - first] =
+                i == first || line->len != prev->len ||
+                memcmp(line->pointer, prev->pointer, line->len) != 0;
+        }
+        removed |= !keep[i - first];
+    }
+    if (removed) {
+        m->undo_cx = m->cx;
+        m->undo_cy = m->cy;
+        fuzzModelText(m, &m->before);
+    }
+    for (int i = last; i >= first; i--) {
+        if (!keep[i - first]) fuzzModelDelete(m, i);
+    }
+    free(keep);
+    if (removed) fuzzModelText(m, &m->after);
+}
 
-    write(STDOUT_FILENO, wBuf.pointer, wBuf.len);
-    bufFree(&wBuf);
+// lines in the order the editor sorts rows: by bytes, a prefix first
+int fuzzLineCompare(const void *a, const void *b) {
+    const struct writeBuf *x = a;
+    const struct writeBuf *y = b;
+    int cmp =
+        memcmp(x->pointer, y->pointer, x->len < y->len ? x->len : y->len);
+    return cmp ? cmp : (x->len > y->len) - (x->len < y->len);
 }
 
-//== == == == == == == == == == == == == == == == == == == == == ==
-//== == ==
-/*** input ***/
-void editorSetStatusMsg(char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(EC.status_msg, sizeof(EC.status_msg), fmt, ap);
-    va_end(ap);
-    EC.status_msg_time = time(NULL);
+// sort lines first..last, reversed for order -1. Equal lines hold the same
+// text, so it does not matter that qsort is not stable. A sort can always be
+// undone, even one that moved nothing.
+void fuzzModelSort(struct fuzzModel *m, int first, int last, int order) {
+    m->undo_cx = m->cx;
+    m->undo_cy = m->cy;
+    fuzzModelText(m, &m->before);
+    int n = last - first + 1;
+    qsort(&m->lines[first], n, sizeof(struct writeBuf), fuzzLineCompare);
+    for (int i = 0; order == -1 && i < n / 2; i++) {
+        struct writeBuf line = m->lines[first + i];
+        m->lines[first + i] = m->lines[last - i];
+        m->lines[last - i] = line;
+    }
+    fuzzModelText(m, &m->after);
 }
 
-void editorMoveCursor(int key) {
-    // curRow points to the row(line) of data that the cursor is
-    // currently on.
-    erow *curRow = (EC.cy >= EC.data_rows) ? NULL : &EC.row[EC.cy];
+// Steps. Arguments are picked from the state of EC, so the same step can be
+// replayed on the model, or left out of it while timing.
 
-    // Update Curosor Position
-    switch (key) {
-        case ARROW_LEFT:
-            if (EC.cx > 0) {
-                EC.cx--;
-            } else if (EC.cy > 0) {
-                EC.cy--;
-                EC.cx = EC.row[EC.cy].size;
+void fuzzStep(enum fuzzOp op, struct fuzzModel *m) {
+    char text[32];
+    int len;
+    int n = EC.data_rows;
+    int row = n ? fuzzRand() % n : 0;
+    if (n == 0 && op >= FUZZ_ROW_INSERT_CHAR && op <= FUZZ_ROW_SET)
+        op = FUZZ_INSERT_ROW;  // no row to edit yet
+    int size = n ? EC.row[row].size : 0;
+    struct writeBuf *line = m && n ? &m->lines[row] : NULL;
+    // frozen rows are thawed before an edit, as drawing them does
+    if (n) editorRowThaw(&EC.row[row]);
+    editorThawRows(EC.cy - 1, EC.cy + 1);
+
+    switch (op) {
+        case FUZZ_INSERT_CHAR: {
+            char c = fuzzByte();
+            fuzzNote(m, "insert-char %02x at %d,%d", (unsigned char)c, EC.cy,
+                     EC.cx);
+            editorInsertChar(c);
+            if (m == NULL) break;
+            if (m->cy == m->len) fuzzModelInsert(m, m->len, "", 0);
+            fuzzSplice(&m->lines[m->cy], m->cx, 0, &c, 1);
+            m->cx++;
+            break;
+        }
+        case FUZZ_INSERT_NEWLINE:
+            fuzzNote(m, "insert-newline at %d,%d", EC.cy, EC.cx);
+            editorInsertNewline();
+            if (m == NULL) break;
+            if (m->cx == 0) {
+                fuzzModelInsert(m, m->cy, "", 0);
+            } else {
+                struct writeBuf *split = &m->lines[m->cy];
+                fuzzModelInsert(m, m->cy + 1, split->pointer + m->cx,
+                                split->len - m->cx);
+                split = &m->lines[m->cy];
+                split->len = m->cx;
             }
+            m->cy++;
+            m->cx = 0;
             break;
-        case ARROW_RIGHT:
-            if (curRow && EC.cx < curRow->size) {
-                EC.cx++;
-            } else if (EC.cy < EC.data_rows) {
-                EC.cy++;
-                EC.cx = 0;
+        case FUZZ_DEL_CHAR:
+            fuzzNote(m, "del-char at %d,%d", EC.cy, EC.cx);
+            editorDelChar();
+            if (m == NULL || m->cy == m->len || (m->cx == 0 && m->cy == 0))
+                break;
+            if (m->cx > 0) {
+                // back over a whole UTF-8 sequence
+                struct writeBuf *cur = &m->lines[m->cy];
+                int start = m->cx - 1;
+                while (start > 0 && (cur->pointer[start] & 0xC0) == 0x80)
+                    start--;
+                fuzzSplice(cur, start, m->cx - start, "", 0);
+                m->cx = start;
+            } else {
+                struct writeBuf *prev = &m->lines[m->cy - 1];
+                m->cx = prev->len;
+                fuzzSplice(prev, prev->len, 0, m->lines[m->cy].pointer,
+                           m->lines[m->cy].len);
+                fuzzModelDelete(m, m->cy);
+                m->cy--;
             }
             break;
-        case ARROW_DOWN:
-            if (EC.cy < EC.data_rows) EC.cy++;
+        case FUZZ_ROW_INSERT_CHAR: {
+            int at = fuzzOffset(size);
+            char c = fuzzByte();
+            fuzzNote(m, "row-insert-char %02x in row %d at %d",
+                     (unsigned char)c, row, at);
+            editorRowInsertChar(&EC.row[row], at, c);
+            if (m == NULL) break;
+            if (at < 0 || at > line->len) at = line->len;
+            fuzzSplice(line, at, 0, &c, 1);
             break;
-        case ARROW_UP:
-            if (EC.cy > 0) EC.cy--;
+        }
+        case FUZZ_ROW_DEL_CHAR: {
+            int at = fuzzOffset(size);
+            fuzzNote(m, "row-del-char in row %d at %d", row, at);
+            editorRowDelChar(&EC.row[row], at);
+            if (m) fuzzModelDelRange(line, at, 1);
             break;
-        case PAGE_UP: {
-            int newYPos = EC.cy - EC.screen_rows;
-            EC.cy = newYPos >= 0 ? newYPos : 0;
-        } break;
-        case PAGE_DOWN: {
-            int newYPos = EC.cy + EC.screen_rows;
-            EC.cy = newYPos <= EC.data_rows ? newYPos : EC.data_rows;
-        } break;
-        case END:
-            EC.cx = curRow->size;
+        }
+        case FUZZ_ROW_DEL_RANGE: {
+            int at = fuzzOffset(size);
+            int count = fuzzOffset(size);
+            fuzzNote(m, "row-del-range in row %d at %d len %d", row, at,
+                     count);
+            editorRowDelRange(&EC.row[row], at, count);
+            if (m) fuzzModelDelRange(line, at, count);
             break;
-        case HOME:
-            EC.cx = 0;
+        }
+        case FUZZ_ROW_APPEND:
+            len = fuzzText(text, 16);
+            fuzzNote(m, "row-append %d bytes to row %d", len, row);
+            editorRowAppendString(&EC.row[row], text, len);
+            if (m) fuzzSplice(line, line->len, 0, text, len);
             break;
-    }
-
-    // if curosr x position is greater than current rows size then
-    // move it back to the last character. 1 character exception as
-    // it will be needed to type new data.
-    curRow = (EC.cy >= EC.data_rows) ? NULL : &EC.row[EC.cy];
-    int curRowLen = curRow ? curRow->size : 0;
-    if (EC.cx > curRowLen) {
-        EC.cx = curRowLen;
-    }
-
-    // Setting curRow to NULL
-    curRow = NULL;
-}
-
-void editorProcessKeyPress() {
-    static int quit_times = TTE_QUIT_TIMES;
-    int key_read = editorReadKey();
-
-    switch (key_read) {
-        case CTRL_KEY('f'):
-            editorFind();
+        case FUZZ_ROW_SET:
+            len = fuzzText(text, 24);
+            fuzzNote(m, "row-set row %d to %d bytes", row, len);
+            editorRowSetString(&EC.row[row], text, len);
+            if (m) fuzzSplice(line, 0, line->len, text, len);
             break;
-        case CTRL_KEY('s'):
-            editorSave();
+        case FUZZ_INSERT_ROW: {
+            int at = fuzzOffset(n);
+            len = fuzzText(text, 24);
+            fuzzNote(m, "insert-row of %d bytes at %d", len, at);
+            editorInsertRow(text, len, at);
+            if (m && at >= 0 && at <= m->len)
+                fuzzModelInsert(m, at, text, len);
             break;
-        case CTRL_KEY('q'):
-            if (EC.dirty && quit_times > 0) {
-                editorSetStatusMsg(
-                    "WARNING!!! File has unsaved changes. Press "
-                    "CTRL-q %d "
-                    "times to quit.",
-                    quit_times);
-                quit_times--;
-                return;
+        }
+        case FUZZ_DEL_ROW: {
+            int at = fuzzOffset(n);
+            fuzzNote(m, "del-row %d", at);
+            editorDelRow(at);
+            if (m && at >= 0 && at < m->len) fuzzModelDelete(m, at);
+            break;
+        }
+        case FUZZ_REPLACE_ROWS: {
+            int at = fuzzRand() % (n + 1);
+            int most = n - at < 4 ? n - at : 4;
+            int count = fuzzRand() % (most + 1);
+            int added = fuzzRand() % 4;
+            erow rows[4];
+            char texts[4][16];
+            int lens[4];
+            for (int i = 0; i < added; i++) {
+                lens[i] = fuzzText(texts[i], 16);
+                editorInitRow(&rows[i], texts[i], lens[i]);
             }
-            editorClearScreen();
-            debugFileLog();
-            bufFree(&dLog);
-            exit(EXIT_SUCCESS);
+            fuzzNote(m, "replace-rows %d at %d with %d", count, at, added);
+            editorReplaceRows(at, count, rows, added, NULL);
+            if (m == NULL) break;
+            for (int i = 0; i < count; i++) fuzzModelDelete(m, at);
+            for (int i = 0; i < added; i++)
+                fuzzModelInsert(m, at + i, texts[i], lens[i]);
             break;
-
-            // Backspace and delete
-            // CTRL + H because it gives out code 8 which was used as
-            // backspace in the olden days
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case DEL_KEY:
-            if (key_read == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
-            editorDelChar();
+        }
+        case FUZZ_FILTER_LINES: {
+            int first = n ? fuzzRand() % n : 0;
+            int last = first + fuzzRand() % 16;
+            if (last >= n) last = n - 1;
+            if (n == 0) break;
+            len = 1 + fuzzRand() % 2;
+            for (int i = 0; i < len; i++) text[i] = fuzzByte();
+            text[len] = '\0';
+            bool uniq = fuzzRand() % 3 == 0;
+            bool invert = fuzzRand() % 4 != 0;  // keeps most rows
+            fuzzNote(m, "%s%s on rows %d-%d", uniq ? "uniq" : "grep",
+                     uniq || !invert ? "" : " -v", first, last);
+            editorThawRows(first, last + 1);
+            editorFilterLines(first, last, uniq ? NULL : text, invert);
+            if (m)
+                fuzzModelFilter(m, first, last, uniq ? NULL : text, len,
+                                invert);
             break;
-            // Carriage Return
-        case '\r':
-            editorInsertNewline();
+        }
+        case FUZZ_UNDO: {
+            bool undoable = EC.undo.kind != UNDO_NONE;
+            fuzzNote(m, "undo%s", undoable ? "" : " of nothing");
+            editorUndo();
+            if (m == NULL || !undoable) break;
+            // the record must not outlive a change to the text
+            struct writeBuf now = WRITEBUF_INIT;
+            fuzzModelText(m, &now);
+            if (now.len != m->after.len ||
+                memcmp(now.pointer, m->after.pointer, now.len) != 0)
+                fuzzFail("undid an edit the text changed after");
+            bufFree(&now);
+            fuzzModelSetText(m, &m->before);
+            m->cx = m->undo_cx;
+            m->cy = m->undo_cy;
+            fuzzModelClamp(m);
             break;
-            // Move Cursor
-        case END:
-        case HOME:
-        case PAGE_UP:
-        case PAGE_DOWN:
-        case ARROW_LEFT:
-        case ARROW_RIGHT:
-        case ARROW_DOWN:
-        case ARROW_UP:
-            editorMoveCursor(key_read);
+        }
+        case FUZZ_FREEZE:
+            EC.rowoff = n ? fuzzRand() % n : 0;
+            fuzzNote(m, "freeze away from row %d", EC.rowoff);
+            EC.warm_mark = 0;
+            editorFreezeRows();
+            editorCompactText();  // whatever the arena's size
             break;
-            // escape
-            // CTRL + L, used for refreshing but we refresh at every
-            // frame so not needed
-        case CTRL_KEY('l'):
-        case '\x1b':
+        case FUZZ_THAW:
+            fuzzNote(m, "thaw all");
+            editorThawAll();
             break;
-
-            // Insert Characters
-        default:
-            editorInsertChar(key_read);
+        case FUZZ_SORT: {
+            if (n == 0) break;
+            int first = fuzzRand() % n;
+            int last = first + fuzzRand() % 16;
+            if (last >= n) last = n - 1;
+            int order = fuzzRand() % 2 ? 1 : -1;
+            fuzzNote(m, "sort%s on rows %d-%d", order == 1 ? "" : " -r",
+                     first, last);
+            editorThawRows(first, last + 1);
+            editorSortRows(first, last, order);
+            if (m) fuzzModelSort(m, first, last, order);
+            break;
+        }
+        case FUZZ_MOVE:
+        case FUZZ_OPS:
+            EC.cy = fuzzRand() % (n + 1);
+            EC.cx = EC.cy < n ? fuzzRand() % (EC.row[EC.cy].size + 1) : 0;
+            fuzzNote(m, "move to %d,%d", EC.cy, EC.cx);
+            if (m == NULL) break;
+            m->cy = EC.cy;
+            m->cx = EC.cx;
             break;
     }
-    quit_times = TTE_QUIT_TIMES;
 }
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
-    size_t buflen = 0;
-    buf[0] = '\0';
-    while (1) {
-        editorSetStatusMsg(prompt, buf);
-        editorRefreshScreen();
-        // cursorToStatusPos(strlen(prompt) + buflen);
-        int c = editorReadKey();
-        if (c == '\x1b') {
-            editorSetStatusMsg("");
-            if (callback) callback(buf, c);
-            free(buf);
-            return NULL;
-        } else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen > 0) {
-                buflen--;
-                buf[buflen] = '\0';
-            }
-        } else if (c == '\r') {
-            if (buflen != 0) {
-                editorSetStatusMsg("");
-                if (callback) callback(buf, c);
-                return buf;
-            }
-        } else if (!iscntrl(c) && c < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
+// editor operations on the cursor, row operations and the row array, mixed
+// so the buffer neither grows nor shrinks for long
+enum fuzzOp fuzzPickOp() {
+    static const enum fuzzOp mix[] = {
+        FUZZ_INSERT_CHAR,     FUZZ_INSERT_CHAR,    FUZZ_INSERT_CHAR,
+        FUZZ_INSERT_NEWLINE,  FUZZ_DEL_CHAR,       FUZZ_DEL_CHAR,
+        FUZZ_DEL_CHAR,        FUZZ_ROW_INSERT_CHAR, FUZZ_ROW_DEL_CHAR,
+        FUZZ_ROW_DEL_RANGE,   FUZZ_ROW_APPEND,     FUZZ_ROW_SET,
+        FUZZ_INSERT_ROW,      FUZZ_INSERT_ROW,     FUZZ_DEL_ROW,
+        FUZZ_REPLACE_ROWS,    FUZZ_MOVE,           FUZZ_MOVE,
+        FUZZ_FILTER_LINES,    FUZZ_UNDO,           FUZZ_FREEZE,
+        FUZZ_THAW,            FUZZ_SORT,
+    };
+    enum fuzzOp op = mix[fuzzRand() % (sizeof(mix) / sizeof(mix[0]))];
+    if (EC.data_rows > 400 && op == FUZZ_INSERT_ROW) op = FUZZ_DEL_ROW;
+    if (EC.data_rows < 100 && op == FUZZ_FILTER_LINES) op = FUZZ_INSERT_ROW;
+    return op;
+}
+
+// Checks, run after every step.
+
+void fuzzCheckRows(struct fuzzModel *m) {
+    if (EC.data_rows != m->len)
+        fuzzFail("%d rows, the model has %d", EC.data_rows, m->len);
+    for (int i = 0; i < m->len; i++) {
+        erow *row = &EC.row[i];
+        const char *chars = editorRowChars(row);
+        struct writeBuf *line = &m->lines[i];
+        if (row->size != line->len ||
+            memcmp(chars, line->pointer, line->len) != 0) {
+            fuzzFail("row %d is \"%.*s\", the model has \"%.*s\"", i,
+                     row->size, chars, line->len, line->pointer);
+        }
+        if (chars[row->size] != '\0')
+            fuzzFail("row %d is not terminated", i);
+        if (row->hash != rowHash(chars, row->size))
+            fuzzFail("row %d has a stale hash", i);
+    }
+}
+
+// byte offset of a random row and the row of a random byte offset
+void fuzzCheckOffsets(struct fuzzModel *m) {
+    if (EC.offsets.valid && EC.offsets.n > EC.data_rows)
+        fuzzFail("the byte index has %d rows, not %d", EC.offsets.n,
+                 EC.data_rows);
+    struct byteIndex *index = editorByteIndex();
+    int probe = fuzzRand() % (m->len + 1);
+    long long total = 0;
+    for (int i = 0; i < m->len; i++) {
+        if (i == probe && byteIndexPrefix(index, i) != total)
+            fuzzFail("row %d starts at byte %lld, not %lld", i,
+                     byteIndexPrefix(index, i), total);
+        total += m->lines[i].len + m->eol;
+    }
+    if (byteIndexPrefix(index, m->len) != total)
+        fuzzFail("%lld bytes, the model has %lld",
+                 byteIndexPrefix(index, m->len), total);
+    if (total == 0) return;
+
+    long long offset = ((long long)fuzzRand() << 16 ^ fuzzRand()) % total;
+    int row = 0;
+    long long start = 0;
+    while (start + m->lines[row].len + m->eol <= offset) {
+        start += m->lines[row].len + m->eol;
+        row++;
+    }
+    long long column;
+    int found = byteIndexFind(index, offset, &column);
+    if (found != row || column != offset - start)
+        fuzzFail("byte %lld is in row %d column %lld, not %d column %lld",
+                 offset, found, column, row, offset - start);
+}
+
+// the buffer is dirty exactly when it differs from the file as saved, though
+// after rows moved it may say so without checking
+void fuzzCheckDirty(struct fuzzModel *m, struct writeBuf *text) {
+    if (fuzzRand() % 4 == 0) editorCheckSaved();
+    fuzzModelText(m, text);
+    bool differs = text->len != m->saved.len ||
+                   memcmp(text->pointer, m->saved.pointer, text->len) != 0;
+    if (EC.dirty != differs && !(EC.rows_moved && EC.dirty))
+        fuzzFail("the buffer is %s but %s the saved file",
+                 EC.dirty ? "dirty" : "clean",
+                 differs ? "differs from" : "matches");
+}
+
+// save to path and compare what the file holds now with the model
+void fuzzCheckSave(struct fuzzModel *m, const char *path,
+                   struct writeBuf *text) {
+    snprintf(fuzzLast, sizeof(fuzzLast), "save");
+    int fd = open(path, O_RDWR);
+    if (fd == -1 || editorWriteRows(fd) == -1) die("fuzz save");
+    editorStampFile(fd);
+    struct writeBuf file = WRITEBUF_INIT;
+    char buf[4096];
+    ssize_t got;
+    while ((got = pread(fd, buf, sizeof(buf), file.len)) > 0)
+        bufAppend(&file, buf, got);
+    close(fd);
+    fuzzModelText(m, text);
+    if (file.len != text->len ||
+        memcmp(file.pointer, text->pointer, text->len) != 0)
+        fuzzFail("the saved file holds %d bytes that differ from the model's "
+                 "%d",
+                 file.len, text->len);
+    if (EC.dirty) fuzzFail("the buffer is dirty right after saving");
+    m->saved.len = 0;
+    bufAppend(&m->saved, text->pointer, text->len);
+    bufFree(&file);
+}
+
+// write lines generated lines of up to width bytes, each ending in eol, to a
+// new temporary file
+void fuzzWriteFile(char *path, int lines, int width, const char *eol) {
+    int fd = mkstemp(path);
+    if (fd == -1) die("mkstemp");
+    struct writeBuf out = WRITEBUF_INIT;
+    char text[256];
+    for (int i = 0; i < lines; i++) {
+        bufAppend(&out, text, fuzzText(text, width));
+        bufAppend(&out, eol, strlen(eol));
+    }
+    if (write(fd, out.pointer, out.len) != out.len) die("write");
+    close(fd);
+    bufFree(&out);
+}
+
+void fuzzProperties(uint64_t seed, long steps, bool crlf) {
+    fuzzState = seed;
+    char path[] = "/tmp/tte-fuzz-XXXXXX";
+    fuzzWriteFile(path, 40, 30, crlf ? "\r\n" : "\n");
+    editorOpen(path);
+
+    struct fuzzModel m = {0};
+    m.eol = crlf ? 2 : 1;
+    for (int i = 0; i < EC.data_rows; i++)
+        fuzzModelInsert(&m, i, EC.row[i].chars, EC.row[i].size);
+    struct writeBuf text = WRITEBUF_INIT;
+    fuzzModelText(&m, &text);
+    bufAppend(&m.saved, text.pointer, text.len);
+
+    snprintf(fuzzLast, sizeof(fuzzLast), "open");
+    if (EC.crlf != crlf) fuzzFail("the line endings were not detected");
+    for (fuzzSteps = 0; fuzzSteps < steps; fuzzSteps++) {
+        fuzzStep(fuzzPickOp(), &m);
+        if (EC.cy != m.cy || EC.cx != m.cx)
+            fuzzFail("cursor at %d,%d, the model has %d,%d", EC.cy, EC.cx,
+                     m.cy, m.cx);
+        // row operations leave the cursor to their callers
+        editorClampCursor();
+        fuzzModelClamp(&m);
+        fuzzCheckRows(&m);
+        fuzzCheckOffsets(&m);
+        fuzzCheckDirty(&m, &text);
+        if (fuzzRand() % 256 == 0) fuzzCheckSave(&m, path, &text);
+    }
+    printf("%ld steps from seed %llu with %s, %d rows at the end: ok\n",
+           steps, (unsigned long long)seed, crlf ? "\"\\r\\n\"" : "\"\\n\"",
+           EC.data_rows);
+
+    editorFreeBuffer();
+    for (int i = 0; i < m.len; i++) free(m.lines[i].pointer);
+    free(m.lines);
+    bufFree(&m.saved);
+    bufFree(&m.before);
+    bufFree(&m.after);
+    bufFree(&text);
+    unlink(path);
+}
+
+// Timing.
+
+// Nanoseconds for a fixed piece of work that does not run any of tte's code.
+// Timings are compared relative to it, so a machine that is slower as a
+// whole, or busy with something else, does not look like a regression.
+double fuzzCalibrate() {
+    static char buf[8192];
+    unsigned int sum = 0;
+    long long start = monotonicNs();
+    for (int i = 0; i < 2000; i++) {
+        memmove(buf + 1, buf, sizeof(buf) - 1);
+        for (int j = 0; j < 256; j++) sum = sum * 31 + buf[j];
+        buf[0] = sum;
+    }
+    return (monotonicNs() - start) / 2000.0;
+}
+
+// Nanoseconds per step of every kind on a buffer of rows lines, the best of
+// a few rounds of count steps, and the calibration time in ns[FUZZ_OPS]. The
+// rounds go over all kinds in turn, and the seed is fixed so every run times
+// the same steps.
+void fuzzTime(int rows, int count, double *ns) {
+    fuzzState = 0x5eed;
+    char path[] = "/tmp/tte-fuzz-XXXXXX";
+    fuzzWriteFile(path, rows, 80, "\n");
+    editorOpen(path);
+    unlink(path);
+    for (int op = 0; op <= FUZZ_OPS; op++) ns[op] = 1e18;
+    for (int round = 0; round < 9; round++) {
+        double calibration = fuzzCalibrate();
+        if (calibration < ns[FUZZ_OPS]) ns[FUZZ_OPS] = calibration;
+        for (int op = 0; op < FUZZ_TIMED; op++) {
+            long long total = 0;
+            for (int i = 0; i < count; i++) {
+                long long start = monotonicNs();
+                fuzzStep(op, NULL);
+                total += monotonicNs() - start;
+                editorClampCursor();
+                fuzzStep(FUZZ_MOVE, NULL);
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
+            if (total < ns[op] * count) ns[op] = (double)total / count;
         }
-        if (callback) callback(buf, c);
     }
+    editorFreeBuffer();
 }
-//== == == == == == == == == == == == == == == == == == == == == ==
-//== == ==
-/*** init ***/
 
-void initEditor() {
-    EC.cx = 0;
-    EC.cy = 0;
-    EC.rx = 0;
-    EC.ry = 0;
-    EC.rowoff = 0;
-    EC.coloff = 0;
-    EC.data_rows = 0;
-    EC.rows_cap = 0;
-    EC.row = NULL;
-    EC.dirty = false;
-    EC.wrap_mode = false;
-    if (getWindowSize(&EC.screen_rows, &EC.screen_cols) == -1) {
-        die("getWindowSize");
+// read a baseline written by fuzzWriteBaseline into ns. Returns false if
+// there is none, or it was timed with other settings.
+bool fuzzReadBaseline(const char *path, int rows, int count, double *ns) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return false;
+    char name[64];
+    double value;
+    int baseRows = -1;
+    int baseCount = -1;
+    for (int op = 0; op <= FUZZ_OPS; op++) ns[op] = 0;
+    while (fscanf(fp, "%63s %lf", name, &value) == 2) {
+        if (strcmp(name, "rows") == 0) baseRows = value;
+        if (strcmp(name, "steps") == 0) baseCount = value;
+        for (int op = 0; op <= FUZZ_OPS; op++) {
+            if (strcmp(name, fuzzOpNames[op]) == 0) ns[op] = value;
+        }
     }
-    EC.screen_cols -= TTE_SIDE_PANEL_WIDTH;
-    EC.max_data_cols = EC.screen_cols;
-    EC.screen_rows -= 2;
-    EC.filename = NULL;
-    EC.status_msg[0] = '\0';
-    EC.status_msg_time = 0;
+    fclose(fp);
+    if (baseRows != rows || baseCount != count) {
+        fprintf(stderr, "%s was timed with -r %d -k %d, not compared\n", path,
+                baseRows, baseCount);
+        return false;
+    }
+    return true;
+}
+
+void fuzzWriteBaseline(const char *path, int rows, int count, double *ns) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) die("fuzzWriteBaseline");
+    fprintf(fp, "rows %d\nsteps %d\n", rows, count);
+    for (int op = 0; op <= FUZZ_OPS; op++) {
+        if (op < FUZZ_TIMED || op == FUZZ_OPS)
+            fprintf(fp, "%s %.1f\n", fuzzOpNames[op], ns[op]);
+    }
+    fclose(fp);
+    printf("baseline written to %s\n", path);
+}
+
+void fuzzUsage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s seed] [-n steps] [-r rows] [-k steps] "
+            "[-B baseline] [-w] [-t percent]\n",
+            prog);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-    enableRawMode();
-    initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    uint64_t seed = 1;
+    long steps = 100000;
+    int rows = 20000;
+    int count = 2000;
+    const char *baseline = NULL;
+    bool rewrite = false;
+    double threshold = 50;
+    int opt;
+    batchMode = true;  // no terminal here either
+    lineCacheEnabled = false;
+    coldRowsEnabled = true;
+    while ((opt = getopt(argc, argv, "s:n:r:k:B:wt:")) != -1) {
+        switch (opt) {
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                steps = atol(optarg);
+                break;
+            case 'r':
+                rows = atoi(optarg);
+                break;
+            case 'k':
+                count = atoi(optarg);
+                break;
+            case 'B':
+                baseline = optarg;
+                break;
+            case 'w':
+                rewrite = true;  // record a new baseline
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            default:
+                fuzzUsage(argv[0]);
+        }
     }
-    editorSetStatusMsg("HELP: CTRL-s to save | CTRL-q to quit");
-    while (true) {
-        editorRefreshScreen();
-        editorProcessKeyPress();
+    if (seed == 0 || rows < 1 || count < 1) fuzzUsage(argv[0]);
+    editorInitBuffer();
+
+    fuzzProperties(seed, steps, false);
+    fuzzProperties(seed, steps, true);
+
+    double ns[FUZZ_OPS + 1];
+    double base[FUZZ_OPS + 1];
+    fuzzTime(rows, count, ns);
+    bool compare = baseline && !rewrite &&
+                   fuzzReadBaseline(baseline, rows, count, base) &&
+                   base[FUZZ_OPS] > 0;
+    bool slower = false;
+    printf("%-16s %9s %9s %8s\n", "step", "ns", "baseline", "change");
+    for (int op = 0; op <= FUZZ_OPS; op++) {
+        if (op >= FUZZ_TIMED && op < FUZZ_OPS) continue;
+        printf("%-16s %9.1f", fuzzOpNames[op], ns[op]);
+        if (compare && op < FUZZ_OPS && base[op] > 0) {
+            // relative to the calibration of each run
+            double change = (ns[op] / ns[FUZZ_OPS]) /
+                                (base[op] / base[FUZZ_OPS]) * 100 -
+                            100;
+            bool regressed = change > threshold;
+            slower |= regressed;
+            printf(" %9.1f %+7.1f%%%s", base[op], change,
+                   regressed ? "  slower" : "");
+        }
+        printf("\n");
+    }
+    if (baseline && (rewrite || access(baseline, F_OK) != 0))
+        fuzzWriteBaseline(baseline, rows, count, ns);
+    if (slower) {
+        printf("slower than the baseline by more than %.0f%%\n", threshold);
+        return EXIT_FAILURE;
     }
     return 0;
 }
+#endif